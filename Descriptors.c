@@ -63,6 +63,12 @@ USB_Descriptor_HIDReport_Datatype_t PROGMEM GenericReport[] =
 	0x15, 0x00,           /*   Logical Minimum (0)                           */
 	0x25, 0xff,           /*   Logical Maximum (255)                         */
 	0x91, 0x02,           /*   Output (Data, Variable, Absolute)             */
+	0x09, 0x04,           /*   Usage (Vendor Defined)                        */
+	0x75, 0x08,           /*   Report Size (8)                               */
+	0x95, GENERIC_FEATURE_SIZE, /*   Report Count (GENERIC_FEATURE_SIZE)     */
+	0x15, 0x00,           /*   Logical Minimum (0)                           */
+	0x25, 0xff,           /*   Logical Maximum (255)                         */
+	0xb1, 0x02,           /*   Feature (Data, Variable, Absolute)            */
 	0xc0                  /* End Collection                                  */
 };
 
@@ -86,17 +92,7 @@ USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
 	.VendorID               = 0x16D0,
 	.ProductID              = 0x05A5,
 
-	#if defined(UNILAB_BASYS_250K)
-	.ReleaseNumber			= DEVICE_BASYS_250K,
-	#elif defined(UNILAB_BASYS_100K)
-	.ReleaseNumber			= DEVICE_BASYS_100K,
-	#elif defined(UNILAB_BREADBOARD)
-	.ReleaseNumber			= DEVICE_UNILAB_BREADBOARD,
-        #elif defined(UNILAB_MARK1)
-        .ReleaseNumber                  = DEVICE_UNILAB_MARK1,
-	#else
-		#error You need to choose a device type!
-	#endif
+	.ReleaseNumber          = DEVICE_MODEL,
 
 	.ManufacturerStrIndex   = 0x01,
 	.ProductStrIndex        = 0x02,
@@ -161,6 +157,7 @@ USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.EndpointAddress        = (ENDPOINT_DESCRIPTOR_DIR_IN | GENERIC_IN_EPNUM),
 			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 			.EndpointSize           = GENERIC_EPSIZE,
+			//The fastest full-speed rate; a floor on console latency (see console.c).
 			.PollingIntervalMS      = 0x01
 		},
 };
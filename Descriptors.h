@@ -65,6 +65,9 @@
 		/** Size in bytes of the Generic HID reports (including report ID byte). */
 		#define GENERIC_REPORT_SIZE       8
 
+		/** Size in bytes of the Generic HID feature reports, which carry replies to commands. */
+		#define GENERIC_FEATURE_SIZE      64
+
 	/* Function Prototypes: */
 		uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 		                                    const uint8_t wIndex,
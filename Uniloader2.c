@@ -39,13 +39,24 @@
 /** Buffer to hold the previously generated HID report, for comparison purposes inside the HID class driver. */
 uint8_t PrevHIDReportBuffer[GENERIC_REPORT_SIZE];
 
-/** Structure to contain reports from the host, so that they can be echoed back upon request */
+/** Progress and result of the commands received from the host, as reported in status reports. */
 struct
 {
-	uint8_t  ReportID;
-	uint16_t ReportSize;
-	uint8_t  ReportData[GENERIC_REPORT_SIZE];
-} HIDReportEcho;
+	uint8_t Received;
+	uint8_t Completed;
+	uint8_t Error;
+	uint8_t FpgaStatus;
+} CommandStatus;
+
+/** Reply to the most recent command, returned to the host as a feature report. If a reply stream is
+ *  set, each feature report is instead generated on demand by the stream's source function.
+ */
+struct
+{
+	uint8_t        ReplySize;
+	uint8_t        ReplyData[GENERIC_FEATURE_SIZE];
+	reply_source_t StreamSource;
+} HIDReply;
 
 /** LUFA HID Class driver interface configuration and state information. This structure is
  *  passed to all HID Class driver functions, so that multiple instances of the same class
@@ -66,11 +77,49 @@ USB_ClassInfo_HID_Device_t Generic_HID_Interface =
 			},
 	};
 
+/** Commands received from the host, waiting to be executed (see executor_task). */
+command_slot CommandQueue[COMMAND_QUEUE_SLOTS];
+uint8_t      CommandHead  = 0;
+uint8_t      CommandCount = 0;
+
+/** The command being executed, and the position of the next byte to be read from its argument.
+ *  If the argument is streamed, it's instead read directly from the control endpoint.
+ */
+command_slot* CurrentCommand;
+uint8_t       ArgumentPosition;
+bool          ArgumentStreamed;
+uint16_t      ArgumentRemaining;
+
+/** True while a command is being executed. */
+bool ExecutorRunning = false;
+
+/** Error code of the executing command (a STATUS_ERROR constant, or STATUS_OK). */
+uint8_t CommandError;
+
+/** Format of the configuration data being uploaded (a BITSTREAM_ constant); see CMD_FPGA_CONFIG_FILE. */
+uint8_t ConfigFormat = BITSTREAM_REVERSED;
+
+/** True while a control request is being handled, during which USB can't be serviced. */
+bool InControlRequest = false;
+
+/** Estimated TCK rate, in Hz; measured at startup. */
+uint32_t TckRate;
+
 /**
  * True iff a connection to the host PC has been made.
  */
 bool connectionMade = false;
 
+/**
+ * State of the USER register read in progress, if any (see CMD_FPGA_USER_READ).
+ */
+struct
+{
+	uint8_t  Flags;
+	bool     Started;
+	uint16_t Remaining;
+} userRead;
+
 /**
  * Status LED blink speed.
  * A higher speed indicates a slower blink.
@@ -89,8 +138,10 @@ int main(void)
 	for (;;)
 	{
                 blink_led();
-		HID_Device_USBTask(&Generic_HID_Interface);
-		USB_USBTask();
+                console_task();
+                boundary_sample_task();
+                executor_task();
+                service_usb();
 	}
 }
 
@@ -112,6 +163,219 @@ void blink_led()
     #    endif
 }
 
+/**
+ * Estimates the TCK rate, by timing a number of idle clocks with the status timer.
+ */
+static uint32_t measure_tck_rate(void)
+{
+    uint16_t start = TCNT1;
+    uint16_t ticks;
+
+    run_test(TCK_MEASURE_CLOCKS);
+    ticks = TCNT1 - start;
+
+    return ticks ? (TCK_MEASURE_CLOCKS * STATUS_TIMER_HZ) / ticks : 0;
+}
+
+/**
+ * Returns: The STATUS_ code for a BITSTREAM_ result.
+ */
+static uint8_t config_error(uint8_t result)
+{
+    switch (result)
+    {
+        case BITSTREAM_OK:
+            return STATUS_OK;
+
+        case BITSTREAM_WRONG_DEVICE:
+            return STATUS_ERROR_DEVICE;
+
+        case BITSTREAM_MALFORMED:
+            return STATUS_ERROR_PACKET;
+
+        default:
+            return STATUS_ERROR_FILE;
+    }
+}
+
+#ifdef SPI_FLASH
+
+/**
+ * Returns: The STATUS_ code for a SPIFLASH_ result.
+ */
+static uint8_t spiflash_error(uint8_t result)
+{
+    switch (result)
+    {
+        case SPIFLASH_OK:
+            return STATUS_OK;
+
+        case SPIFLASH_NO_BRIDGE:
+            return STATUS_ERROR_BRIDGE;
+
+        default:
+            return STATUS_ERROR_TIMEOUT;
+    }
+}
+
+#endif
+
+/**
+ * Checks and sends a block of configuration data to the FPGA, in the format of the upload
+ * (see CMD_FPGA_CONFIG_FILE). Once a problem with the bitstream is found, nothing more is sent.
+ */
+static void send_config_block(const uint8_t* data, uint8_t length, bool first, bool last)
+{
+#ifdef BITSTREAM_FILES
+    if (ConfigFormat == BITSTREAM_FILE)
+    {
+        bitstream_send_block(data, length);
+        return;
+    }
+#endif
+
+    if (bitstream_check_block(data, length))
+        fpga_send_config_block(data, length, first, last);
+}
+
+#if defined(SD_CARD) || defined(FLASH_IMAGE)
+
+/**
+ * Configures the FPGA with a bitstream fetched a byte at a time from a source (see
+ * jtag_shift_stream), as CMD_FPGA_CONFIG_START through CMD_FPGA_CONFIG_END would.
+ *
+ * format: The format of the data (a BITSTREAM_ constant).
+ *
+ * Returns: A STATUS_ code.
+ */
+static uint8_t configure_fpga_stream(jtag_byte_source source, uint32_t length, uint8_t format)
+{
+    uint8_t result = STATUS_OK;
+
+    console_set_enabled(false);
+    boundary_sample_stop(NULL);
+    fpga_set_power(1);
+    fpga_reset();
+
+    if (!fpga_init_config(true))
+        return STATUS_ERROR_TIMEOUT;
+
+    //a bitstream which can't work is abandoned as soon as it's found out
+    result = config_error(bitstream_send_stream(source, length, format));
+
+    if (result == STATUS_OK && !fpga_finish_config())
+        result = STATUS_ERROR_CONFIG;
+
+    CommandStatus.FpgaStatus = fpga_get_status();
+
+    blinkOn = 1000;
+    blinkOff = 1;
+
+    return result;
+}
+
+#endif
+
+#ifdef FLASH_IMAGE
+
+/**
+ * Configures the FPGA from the compressed bitstream image in flash; see image.h.
+ *
+ * Returns: A STATUS_ code.
+ */
+static uint8_t image_configure_fpga(void)
+{
+    uint32_t length;
+    uint8_t  result;
+
+    if (!image_start(&length))
+        return STATUS_ERROR_IMAGE;
+
+    result = configure_fpga_stream(image_next, length, BITSTREAM_FILE);
+
+    if (result == STATUS_OK && !image_finish())
+        result = STATUS_ERROR_IMAGE;
+
+    return result;
+}
+
+#endif
+
+#ifdef SD_CARD
+
+/**
+ * Configures the FPGA from a bitstream file on the SD card, streaming the file
+ * straight to the JTAG chain; see sd.h.
+ *
+ * length: The length of the data, from the start of the file.
+ * format: The format of the data (a BITSTREAM_ constant).
+ *
+ * Returns: A STATUS_ code.
+ */
+static uint8_t sd_configure_fpga(const sd_file* file, uint32_t length, uint8_t format)
+{
+    uint8_t result;
+
+    //the card can only be used for one thing at a time
+    cache_capture_abort();
+
+    if (!sd_read_start(file))
+    {
+        sd_read_stop();
+        return STATUS_ERROR_SD;
+    }
+
+    result = configure_fpga_stream(sd_read_next, length, format);
+
+    if (!sd_read_stop())
+        result = STATUS_ERROR_SD;
+
+    return result;
+}
+
+/**
+ * Configures the FPGA from the SD card's boot file, if one is set.
+ *
+ * Returns: True iff the FPGA was configured.
+ */
+static bool sd_boot(void)
+{
+    char    name[SD_NAME_LENGTH];
+    sd_file file;
+
+    sd_get_boot_name(name);
+
+    if (!sd_name_valid(name))
+        return false;
+
+    if (sd_find(name, &file))
+        CommandStatus.Error = sd_configure_fpga(&file, file.size, BITSTREAM_FILE);
+    else
+        CommandStatus.Error = STATUS_ERROR_SD;
+
+    return CommandStatus.Error == STATUS_OK;
+}
+
+#endif
+
+/**
+ * Configures the FPGA at power-up, so the board comes up configured without a host:
+ * from the SD card's boot file, if one is set; or else from the image in flash, if
+ * one is stored.
+ */
+static void boot_fpga(void)
+{
+#ifdef SD_CARD
+    if (sd_boot())
+        return;
+#endif
+
+#ifdef FLASH_IMAGE
+    if (image_present())
+        CommandStatus.Error = image_configure_fpga();
+#endif
+}
+
 /** Configures the board hardware and chip peripherals for the demo's functionality. */
 void SetupHardware(void)
 {
@@ -126,33 +390,26 @@ void SetupHardware(void)
     TCCR1B |= ((1 << CS12) | (0 << CS11) | (1 << CS10)); //occurs @ 15,625 hz
     ONBOARD_LED_DDR |= 1 << ONBOARD_LED_PIN;
 
-    //Set up our 2(?)MHz clock, which drives the FPGA when the microcontroller
-    //is not programmed:
-
-    //set the clock prescalar to 1x (i.e. system clock)
-    TCCR4B |= (1 << CS40);
-    TCCR4B &= ~(1 << CS41 | 1 << CS42 | 1 << CS43 | 1 << DTPS40 | 1 << DTPS41); //FIXME DTPS41, DTPS40
-
-    //set pin D7 to output
-    DDRD |= 1 << PD7;
-    PORTD |= 1 << PD7;
-
-
-        //set pin D7 / OC4D to toggle each time the counter is cleared
-        OCR4D = 0;
-        TCCR4C |= 1 << COM4D0;
-        TCCR4C &= ~(1 << COM4D1);
-
-        //Each time the clock is >= 0 (i.e. every time), clear the timer
-        OCR4C = 0; //2;
+    //Start the performance counters' cycle timer.
+    stats_initialize();
 
+    //Set up the clock which drives the FPGA; by default, this is the system
+    //clock divided by two. The host can reprogram it with CMD_SET_CLOCK_OUT.
+    clock_out_initialize();
 
     /* Relocate the interrupt vector table to the bootloader section */
     MCUCR = (1 << IVCE);
     MCUCR = (1 << IVSEL);
 
-    //init the JTAG chain
+    //init the JTAG chain, and time it for CMD_WHOAMI
     jtag_initialize();
+    TckRate = measure_tck_rate();
+
+    //configure the FPGA from storage, if possible, before the host's commands can disturb it
+    boot_fpga();
+
+    //from here on, service USB during long waits
+    jtag_idle_callback = executor_yield;
 
     /* Initialize USB subsystem */
     USB_Init();
@@ -185,6 +442,14 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
+	/* Feature reports carry replies to commands, and are handled here rather than by the class driver */
+	if ((USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE)) &&
+	    (USB_ControlRequest.bRequest == REQ_GetReport) && ((USB_ControlRequest.wValue >> 8) == REPORT_TYPE_Feature))
+	{
+		send_reply();
+		return;
+	}
+
 	HID_Device_ProcessControlRequest(&Generic_HID_Interface);
 
         //check for req?
@@ -212,13 +477,37 @@ bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDIn
                                          void* ReportData,
                                          uint16_t* const ReportSize)
 {
-	if (HIDReportEcho.ReportID)
-	  *ReportID = HIDReportEcho.ReportID;
+#ifdef JTAG_CONSOLE
+	/* While the console has characters waiting, IN reports carry them */
+	if (console_is_enabled() && (ReportType == HID_REPORT_ITEM_In))
+	{
+		uint8_t* Report = ReportData;
+
+		Report[0] = IN_REPORT_CONSOLE;
+		Report[1] = console_read(&Report[2], GENERIC_REPORT_SIZE - 2);
+
+		*ReportSize = GENERIC_REPORT_SIZE;
+
+		/* Force the report out whenever it has characters, even if they match the last report's */
+		if (Report[1])
+			return true;
+	}
+#endif
 
-	memcpy(ReportData, HIDReportEcho.ReportData, HIDReportEcho.ReportSize);
+	/* Otherwise, IN reports carry the device's status */
+	status_report* Status = ReportData;
 
-	*ReportSize = HIDReportEcho.ReportSize;
-	return true;
+	Status->Type       = IN_REPORT_STATUS;
+	Status->Received   = CommandStatus.Received;
+	Status->Completed  = CommandStatus.Completed;
+	Status->Flags      = CommandCount ? STATUS_BUSY : 0;
+	Status->Error      = CommandStatus.Error;
+	Status->FpgaStatus = CommandStatus.FpgaStatus;
+
+	*ReportSize = sizeof(status_report);
+
+	/* Status reports are only sent when the status changes */
+	return false;
 }
 
 /** HID class driver callback function for the processing of HID reports from the host.
@@ -235,189 +524,1361 @@ void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDI
                                           const void* ReportData,
                                           const uint16_t ReportSize)
 {
-	HIDReportEcho.ReportID   = ReportID;
-	HIDReportEcho.ReportSize = ReportSize;
-	memcpy(HIDReportEcho.ReportData, ReportData, ReportSize);
+	/* Commands are received and queued by EVENT_USB_Device_UnhandledControlRequest */
 }
 
 
-/** Event handler for the USB_UnhandledControlRequest event. This is used to catch standard and class specific
- *  control requests that are not handled internally by the USB library (including the HID commands, which are
- *  all issued via the control endpoint), so that they can be handled appropriately for the application.
+/**
+ * Sets the data returned to the host in response to feature report requests,
+ * ending any reply stream. Data longer than a feature report is truncated.
  */
-void EVENT_USB_Device_UnhandledControlRequest(void)
+void set_reply(const void* data, uint8_t size)
 {
-    //once we're attached via USB, stop blinking
-    blinkOn = 1000;
-    blinkOff = 1;
+    if (size > GENERIC_FEATURE_SIZE)
+        size = GENERIC_FEATURE_SIZE;
 
-    /* Handle HID Class specific requests */
-    if (USB_ControlRequest.bRequest == REQ_SetReport)
+    memcpy(HIDReply.ReplyData, data, size);
+
+    HIDReply.ReplySize    = size;
+    HIDReply.StreamSource = NULL;
+}
+
+/**
+ * Starts a reply stream: each following feature report is filled by the given source,
+ * which returns the number of bytes it produced. The stream ends once the source
+ * produces no data, or when a new reply is set.
+ */
+void set_reply_stream(reply_source_t source)
+{
+    HIDReply.ReplySize    = 0;
+    HIDReply.StreamSource = source;
+}
+
+/**
+ * Sends the current reply over the control endpoint, in response to a feature report request.
+ */
+void send_reply(void)
+{
+    uint16_t length = USB_ControlRequest.wLength;
+
+    if (length > GENERIC_FEATURE_SIZE)
+        length = GENERIC_FEATURE_SIZE;
+
+    Endpoint_ClearSETUP();
+
+    //if a command is executing or queued, the reply isn't ready (and the JTAG chain is
+    //busy); send an empty reply, which the host should retry once the main loop has
+    //run the queue. Commands are never run here, where USB can't be serviced.
+    if (ExecutorRunning || CommandCount)
+        length = 0;
+
+    //if a stream is active, generate the next chunk of the reply
+    if (HIDReply.StreamSource && length)
     {
-        //Once communications have started, speed up our LED blink.
-        connectionMade = true;
+        HIDReply.ReplySize = HIDReply.StreamSource(HIDReply.ReplyData, length);
 
-        Endpoint_ClearSETUP();
+        if (!HIDReply.ReplySize)
+            HIDReply.StreamSource = NULL;
+    }
+
+    if (length > HIDReply.ReplySize)
+        length = HIDReply.ReplySize;
 
-        /* Wait until the command has been sent by the host */
+    Endpoint_Write_Control_Stream_LE(HIDReply.ReplyData, length);
+    Endpoint_ClearOUT();
+}
+
+/**
+ * Reads the next byte of the control endpoint's OUT data, waiting for the
+ * host to send the next packet as needed.
+ */
+static uint8_t endpoint_read_byte(void)
+{
+    if (!(Endpoint_BytesInEndpoint()))
+    {
+        uint32_t start;
+
+        Endpoint_ClearOUT();
+
+        start = stats_now();
         while (!(Endpoint_IsOUTReceived()));
+        stats_add(STATS_USB_WAIT, start);
+    }
 
-        //speed up after the first packet has been received
-        //TODO: unspeed (i.e. slow) after idle
-        blinkOn = blinkOff = 1600;
+    return Endpoint_Read_Byte();
+}
 
-        /* Read in the write destination address */
-        uint16_t PageAddress = Endpoint_Read_Word_LE();
+/**
+ * Returns the number of bytes of the executing command's argument which haven't been read.
+ */
+static uint16_t arg_remaining(void)
+{
+    return ArgumentRemaining;
+}
 
-        //If we've received the RESTART_BOOTLOADER command, restart.
-        switch (PageAddress)
-        {
-            //Hard reset.
-            case CMD_RESTART:
-                //RunBootloader = false;
-                hard_reset();
-                break;
+/**
+ * Reads the next byte of the executing command's argument.
+ * Reads beyond the end of the argument return zero.
+ */
+static uint8_t arg_read_byte(void)
+{
+    if (!ArgumentRemaining)
+        return 0;
 
-            //Soft reset
-            case CMD_SOFT_RESET:
-                USB_Detach();
-                asm volatile("jmp 0000");
-                break;
+    --ArgumentRemaining;
 
-            case CMD_FPGA_OFF:
-                //FIXME
-                break;
+    if (ArgumentStreamed)
+        return endpoint_read_byte();
+
+    return CurrentCommand->Argument[ArgumentPosition++];
+}
+
+/**
+ * Reads the next block of the executing command's argument: for streamed arguments, as
+ * much as is waiting in the endpoint (up to size bytes); otherwise, up to size bytes of
+ * the queued argument, which isn't copied.
+ *
+ * buffer: Receives the data, if it needs to be copied.
+ * length: Receives the number of bytes read; zero once the argument is exhausted.
+ *
+ * Returns: A pointer to the data read.
+ */
+static const uint8_t* arg_read_block(uint8_t* buffer, uint8_t size, uint8_t* length)
+{
+    const uint8_t* data;
+
+    if (size > ArgumentRemaining)
+        size = ArgumentRemaining;
+
+    if (ArgumentStreamed && size)
+    {
+        //wait for the next packet, if this one has been read
+        buffer[0] = endpoint_read_byte();
 
-                //Begin FPGA Configuration:
-                //
-                //Send the correct JTAG sequence to begin configuration,
-                //then sends the 128 byte argument over the configuration line.
-            case CMD_FPGA_CONFIG_START:
+        if (size > Endpoint_BytesInEndpoint() + 1)
+            size = Endpoint_BytesInEndpoint() + 1;
 
-                //ensure the FPGA is powered on
-                fpga_set_power(1);
+        for (uint8_t byteNo = 1; byteNo < size; ++byteNo)
+            buffer[byteNo] = Endpoint_Read_Byte();
 
-                //reset the FPGA
-                fpga_reset();
+        data = buffer;
+    }
+    else
+    {
+        data = &CurrentCommand->Argument[ArgumentPosition];
+        ArgumentPosition += size;
+    }
 
-                //start FPGA configuration
-                fpga_init_config(true);
+    ArgumentRemaining -= size;
+    *length = size;
 
-                //and roll into the data send operation
+    return data;
+}
 
+/**
+ * Reads the next 16-bit (little endian) word of the executing command's argument.
+ */
+static uint16_t arg_read_word(void)
+{
+    uint16_t low = arg_read_byte();
 
-                //Continue FPGA Configuration
-                //
-                //Sends the 128-bytes argument over the FPGA configuration line.
-            case CMD_FPGA_CONFIG_SEND:
+    return low | ((uint16_t)arg_read_byte() << 8);
+}
 
-                //for(uint8_t byteNo = 0; byteNo < BYTES_PER_PACKET; ++byteNo)
-                for (uint8_t byteNo = 0; byteNo < 128; ++byteNo) //DEBUG
-                {
-                    /* Check if endpoint is empty - if so clear it and wait until ready for next packet */
-                    if (!(Endpoint_BytesInEndpoint()))
-                    {
-                        Endpoint_ClearOUT();
-                        while (!(Endpoint_IsOUTReceived()));
-                    }
+/**
+ * Reads part of the executing command's argument into a buffer.
+ */
+static void arg_read(void* buffer, uint8_t length)
+{
+    uint8_t* data = buffer;
 
+    for (uint8_t byteNo = 0; byteNo < length; ++byteNo)
+        data[byteNo] = arg_read_byte();
+}
 
-                    //determine if this is the first byte
-                    bool firstByte = (byteNo == 0) && (PageAddress == CMD_FPGA_CONFIG_START);
+/**
+ * Reply stream source for CMD_FPGA_USER_READ; shifts the next chunk of the
+ * requested read out of the selected USER register.
+ */
+static uint8_t user_read_source(uint8_t* buffer, uint8_t size)
+{
+    uint8_t byteNo;
 
-                    //and send the configuration data received
-                    fpga_send_config((char) Endpoint_Read_Byte(), firstByte, false);
+    for (byteNo = 0; byteNo < size && userRead.Remaining; ++byteNo)
+    {
+        bool first = (userRead.Flags & USER_SCAN_FIRST) && userRead.Started == false;
+        bool last  = (userRead.Flags & USER_SCAN_LAST) && userRead.Remaining == 1;
 
-                }
-                break;
+        buffer[byteNo] = fpga_user_shift(0x00, first, last);
 
-                //Finishes FPGA communication.
-                //
-                //The argument to this command is slightly different from the others-
-                //the first byte indicates the amount of argument data that should follow.
-                //
-                //This enables the use of variable-sized bit-streams (such as compressed bit-streams.)
-            case CMD_FPGA_CONFIG_END:
+        userRead.Started = true;
+        --userRead.Remaining;
+    }
 
-            {
-                //determine the data length to be read
-                uint8_t dataLength = Endpoint_Read_Byte();
+    return byteNo;
+}
 
+#ifdef BOUNDARY_SCAN
 
-                //and send the configuration data
-                for (uint8_t byteNo = 0; byteNo < 128; ++byteNo)
-                {
-                    /* Check if endpoint is empty - if so clear it and wait until ready for next packet */
-                    if (!(Endpoint_BytesInEndpoint()))
-                    {
-                        Endpoint_ClearOUT();
-                        while (!(Endpoint_IsOUTReceived()));
-                    }
-
-                    if (byteNo < dataLength)
-                        fpga_send_config((char) Endpoint_Read_Byte(), false, byteNo == dataLength - 1);
-                }
+/**
+ * Reply stream source for CMD_BOUNDARY_SAMPLE_START; sends the snapshot data
+ * captured so far, prefixed with its length.
+ */
+static uint8_t boundary_sample_source(uint8_t* buffer, uint8_t size)
+{
+    buffer[0] = boundary_sample_read(&buffer[1], size - 1);
 
-                //clear status (runtest takes a while?)
+    //keep the stream running, even when no data is waiting
+    return buffer[0] + 1;
+}
 
-                Endpoint_ClearOUT();
-                Endpoint_ClearStatusStage();
+#endif
 
-                //finalize the configuration and start the FPGA
-                fpga_finish_config();
+/**
+ * Waits for a self-programming operation to complete, servicing USB meanwhile.
+ */
+static void spm_busy_wait(void)
+{
+    uint32_t start = stats_now();
 
-                //stop blinking once the programming is complete
-                blinkOn = 1000;
-                blinkOff = 1;
+    while (boot_spm_busy())
+        executor_yield();
 
-                //TODO: prevent intermittant comm. error
+    stats_add(STATS_SPM_WAIT, start);
+}
 
+/**
+ * Executes a single command from the host.
+ *
+ * PageAddress: The command word; or, for flash writes, the address of the page to be written.
+ *              The command's argument is read with the arg_read functions.
+ */
+static void execute_command(uint16_t PageAddress)
+{
+    //If we've received the RESTART_BOOTLOADER command, restart.
+    switch (PageAddress)
+    {
+        //Hard reset.
+        case CMD_RESTART:
+            //RunBootloader = false;
+            hard_reset();
+            break;
+
+        //Soft reset
+        case CMD_SOFT_RESET:
+
+#ifdef FLASH_IMAGE
+            //while a bitstream image is stored, there's no application to run
+            if (image_present())
+            {
+                CommandError = STATUS_ERROR_IMAGE;
                 break;
             }
+#endif
 
+            USB_Detach();
 
-                //SD card config items here
-
+            //leave nothing running which the application doesn't expect: the timers'
+            //interrupts would otherwise be taken by the bootloader's handlers, which
+            //would write to the application's RAM
+            cli();
+            stats_stop();
+            clock_out_stop();
 
-            default:
+            //and return the interrupt vectors to the application section
+            MCUCR = (1 << IVCE);
+            MCUCR = 0;
 
-                //If the address to be written is beyond the end of user memory,
-                //ignore the instruction
-                if (PageAddress >= BOOTLOADER_START)
-                    break;
+            asm volatile("jmp 0000");
+            break;
 
+        //Identify the device, so the host can pick the fastest protocol it supports.
+        case CMD_WHOAMI:
+        {
+            whoami_reply Reply;
+
+            Reply.ProtocolVersion = PROTOCOL_VERSION;
+            Reply.BoardModel      = DEVICE_MODEL;
+            Reply.Features        = DEVICE_FEATURES;
+#ifdef CLOCK_OUT
+            Reply.Features       |= FEATURE_CLOCK_OUT;
+#endif
+#ifdef PERF_STATS
+            Reply.Features       |= FEATURE_STATS;
+#endif
+#ifdef SELF_BENCH
+            Reply.Features       |= FEATURE_BENCH;
+#endif
+#ifdef JTAG_CONSOLE
+            Reply.Features       |= FEATURE_CONSOLE;
+#endif
+#ifdef BOUNDARY_SCAN
+            Reply.Features       |= FEATURE_BOUNDARY_SCAN;
+#endif
+#ifdef BITSTREAM_FILES
+            Reply.Features       |= FEATURE_CONFIG_FILE;
+#endif
+#ifdef FLASH_IMAGE
+            Reply.Features       |= FEATURE_COMPRESSION;
+#endif
+#ifdef SPI_FLASH
+            Reply.Features       |= FEATURE_SPI_JTAG;
+#endif
+#ifdef JTAG_TRACE
+            Reply.Features       |= FEATURE_JTAG_TRACE;
+#endif
+#if JTAG_LANES > 1
+            Reply.Features       |= FEATURE_JTAG_LANES;
+#endif
+#ifdef SD_CARD
+            Reply.Features       |= FEATURE_SD_CARD | FEATURE_CACHE;
+#endif
+            Reply.MaxTransfer     = MAX_ARGUMENT_SIZE;
+            Reply.MaxReply        = GENERIC_FEATURE_SIZE;
+            Reply.PageSize        = SPM_PAGESIZE;
+            Reply.BootloaderStart = BOOTLOADER_START;
+            Reply.TckRate         = TckRate;
+            Reply.FpgaIdcode      = fpga_idcode;
+
+            set_reply(&Reply, sizeof(Reply));
+            break;
+        }
 
-                /* Erase the given FLASH page, ready to be programmed */
-                boot_page_erase(PageAddress);
-                boot_spm_busy_wait();
+#ifdef PERF_STATS
 
-                /* Write each of the FLASH page's bytes in sequence */
-                for (uint8_t PageByte = 0; PageByte < SPM_PAGESIZE; PageByte += 2)
-                {
-                    /* Check if endpoint is empty - if so clear it and wait until ready for next packet */
-                    if (!(Endpoint_BytesInEndpoint()))
-                    {
-                        Endpoint_ClearOUT();
-                        while (!(Endpoint_IsOUTReceived()));
-                    }
+        //Read the performance counters.
+        //
+        //The argument is a byte of STATS_ flags.
+        case CMD_STATS:
+        {
+            stats_report Report;
+            uint8_t      flags = arg_read_byte();
 
-                    /* Write the next data word to the FLASH page */
-                    boot_page_fill(PageAddress + PageByte, Endpoint_Read_Word_LE());
-                }
+            stats_read(&Report);
+            set_reply(&Report, sizeof(Report));
 
-                /* Write the filled FLASH page to memory */
-                boot_page_write(PageAddress);
-                boot_spm_busy_wait();
+            if (flags & STATS_READ_RESET)
+                stats_reset();
 
-                /* Re-enable RWW section */
-                boot_rww_enable();
-                break;
+            break;
         }
 
-        //discard the output data and status
-        Endpoint_ClearOUT();
-        Endpoint_ClearStatusStage();
+#endif
 
-    }
-}
+#ifdef SELF_BENCH
 
+        //Run a self-benchmark.
+        //
+        //The argument is the BENCH_ mode (one byte), and a 32-bit count: the
+        //number of bytes to transfer; or, for BENCH_FLASH, the number of passes.
+        case CMD_BENCH:
+        {
+            uint8_t  mode = arg_read_byte();
+            uint32_t count;
+
+            arg_read(&count, sizeof(count));
+
+            switch (mode)
+            {
+                case BENCH_USB_SINK:
+                    bench_usb_start(mode, count);
+                    break;
+
+                case BENCH_USB_SOURCE:
+                    bench_usb_start(mode, count);
+                    set_reply_stream(bench_usb_source);
+                    break;
+
+                case BENCH_JTAG:
+                    boundary_sample_stop(NULL);
+                    bench_jtag(count);
+                    set_reply(&bench, sizeof(bench));
+                    break;
+
+                case BENCH_FLASH:
+                    bench_flash((count > BENCH_FLASH_MAX_PASSES) ? BENCH_FLASH_MAX_PASSES : count);
+                    set_reply(&bench, sizeof(bench));
+                    break;
+
+                default:
+                    CommandError = STATUS_ERROR_ARGUMENT;
+                    break;
+            }
+
+            break;
+        }
+
+        //Data for a BENCH_USB_SINK benchmark; discarded.
+        case CMD_BENCH_DATA:
+        {
+            uint16_t length = arg_remaining();
+
+            while (arg_remaining())
+                arg_read_byte();
+
+            bench_usb_sink(length);
+            break;
+        }
+
+        //Read the result of the last benchmark.
+        case CMD_BENCH_RESULT:
+            set_reply(&bench, sizeof(bench));
+            break;
+
+#endif
+
+        //Dump the JTAG trace. Entries are removed as they're read.
+        case CMD_JTAG_TRACE:
+            set_reply_stream(jtag_trace_read);
+            break;
+
+        //Select the JTAG lanes to drive.
+        //
+        //The argument is a bitmask of the lanes to enable, and the lane whose
+        //TDO is used for status (one byte each); see jtag_set_lanes.
+        case CMD_JTAG_LANES:
+        {
+            uint8_t enabled  = arg_read_byte();
+            uint8_t selected = arg_read_byte();
+            uint8_t lanes    = JTAG_LANES;
+
+            boundary_sample_stop(NULL);
+
+            if (!jtag_set_lanes(enabled, selected))
+                CommandError = STATUS_ERROR_ARGUMENT;
+
+            set_reply(&lanes, sizeof(lanes));
+            break;
+        }
+
+#ifdef CLOCK_OUT
+
+        //Reprogram the FPGA clock.
+        //
+        //The argument is the Timer4 clock source, prescaler select, TOP and
+        //duty values (one byte each); see clock_out_set. The frequency achieved,
+        //in Hz, is returned as the command's reply.
+        case CMD_SET_CLOCK_OUT:
+        {
+            uint8_t source    = arg_read_byte();
+            uint8_t prescaler = arg_read_byte();
+            uint8_t top       = arg_read_byte();
+            uint8_t duty      = arg_read_byte();
+
+            uint32_t frequency = clock_out_set(source, prescaler, top, duty);
+
+            if (!frequency)
+                CommandError = STATUS_ERROR_ARGUMENT;
+
+            set_reply(&frequency, sizeof(frequency));
+            break;
+        }
+
+#endif
+
+        case CMD_FPGA_OFF:
+            //FIXME
+            break;
+
+#ifdef BITSTREAM_FILES
+
+            //Begin FPGA Configuration from a configuration file.
+            //
+            //As CMD_FPGA_CONFIG_START, but the data (of this command, and of the
+            //CMD_FPGA_CONFIG_SEND and CMD_FPGA_CONFIG_END which follow) is a .bit or
+            //.bin file, exactly as written by bitgen; see jtag/bitstream.h.
+            //The bitstream's end is found from the file's header, if it has one, or
+            //else is the end of CMD_FPGA_CONFIG_END's data. If the file was empty or
+            //cut short, CMD_FPGA_CONFIG_END fails with STATUS_ERROR_FILE.
+        case CMD_FPGA_CONFIG_FILE:
+
+#endif
+
+            //Begin FPGA Configuration:
+            //
+            //Send the correct JTAG sequence to begin configuration,
+            //then sends the argument over the configuration line.
+        case CMD_FPGA_CONFIG_START:
+
+            ConfigFormat = (PageAddress == CMD_FPGA_CONFIG_FILE) ? BITSTREAM_FILE : BITSTREAM_REVERSED;
+
+            //stop polling the console and capturing boundary snapshots, which would
+            //disturb configuration
+            console_set_enabled(false);
+            boundary_sample_stop(NULL);
+
+            //ensure the FPGA is powered on
+            fpga_set_power(1);
+
+            //reset the FPGA
+            fpga_reset();
+
+            //start FPGA configuration
+            if (!fpga_init_config(true))
+            {
+                CommandError = STATUS_ERROR_TIMEOUT;
+                break;
+            }
+
+            bitstream_start(ConfigFormat);
+
+            //and, after a cache miss, copy the bitstream into the cache
+            cache_capture_start(ConfigFormat);
+
+            //and roll into the data send operation
+
+
+            //Continue FPGA Configuration
+            //
+            //Sends the whole argument over the FPGA configuration line; large
+            //arguments are streamed as they arrive. The bitstream is checked on the
+            //way (see jtag/bitstream.h); once a problem is found, configuration is
+            //abandoned, the rest of the bitstream is discarded, and each command
+            //fails with STATUS_ERROR_DEVICE, STATUS_ERROR_PACKET or STATUS_ERROR_FILE.
+        case CMD_FPGA_CONFIG_SEND:
+        {
+            //determine if this is the first block
+            bool           firstBlock = (PageAddress != CMD_FPGA_CONFIG_SEND);
+            uint8_t        block[ARGUMENT_BLOCK_SIZE];
+            const uint8_t* data;
+            uint8_t        length;
+
+            //and send the configuration data received, a block at a time
+            while (arg_remaining())
+            {
+                data = arg_read_block(block, sizeof(block), &length);
+
+                send_config_block(data, length, firstBlock, false);
+                cache_capture(data, length);
+                firstBlock = false;
+            }
+
+            //report a bad bitstream right away, so the host can stop sending it
+            CommandError = config_error(bitstream_error());
+            break;
+        }
+
+            //Finishes FPGA communication.
+            //
+            //The argument to this command is slightly different from the others-
+            //the first byte indicates the amount of argument data that should follow.
+            //
+            //This enables the use of variable-sized bit-streams (such as compressed bit-streams.)
+            //As the length is a single byte, the command carries at most 255 bytes of data; an
+            //argument longer than that, which can't be padding, fails with STATUS_ERROR_ARGUMENT
+            //before anything is sent. Larger amounts of data should be sent with
+            //CMD_FPGA_CONFIG_SEND, before a short (or empty) CMD_FPGA_CONFIG_END.
+        case CMD_FPGA_CONFIG_END:
+
+        {
+            uint8_t        block[ARGUMENT_BLOCK_SIZE];
+            const uint8_t* data;
+            uint8_t        length;
+            uint8_t        dataLength;
+
+            if (arg_remaining() > 1 + UINT8_MAX)
+            {
+                CommandError = STATUS_ERROR_ARGUMENT;
+                break;
+            }
+
+            //determine the data length to be read
+            dataLength = arg_read_byte();
+
+            if (dataLength > arg_remaining())
+                dataLength = arg_remaining();
+
+            //and send the configuration data, ending the bitstream with its last block
+            while (dataLength)
+            {
+                data = arg_read_block(block, (dataLength < sizeof(block)) ? dataLength : sizeof(block), &length);
+                dataLength -= length;
+
+                send_config_block(data, length, false, dataLength == 0);
+                cache_capture(data, length);
+            }
+
+            //a file's bitstream ends with the file, unless its header says otherwise
+            CommandError = config_error(bitstream_finish());
+
+            //finalize the configuration and start the FPGA, unless the bitstream was abandoned
+            if (CommandError == STATUS_OK && !fpga_finish_config())
+                CommandError = STATUS_ERROR_CONFIG;
+
+            cache_capture_end(CommandError == STATUS_OK);
+
+            //and record its final status
+            CommandStatus.FpgaStatus = fpga_get_status();
+
+            //stop blinking once the programming is complete
+            blinkOn = 1000;
+            blinkOff = 1;
+
+            break;
+        }
+
+
+            //Continue FPGA configuration, with a separate bitstream for each lane.
+            //
+            //The argument is a byte of CONFIG_LANES flags, followed by the data: one
+            //byte for each lane in turn (lane zero first), repeated. Configuration is
+            //started with CMD_FPGA_CONFIG_START as usual, whose data is sent to every
+            //lane; it may be padding (0xFF), which the FPGAs ignore before the sync word.
+            //When CONFIG_LANES_LAST is set, the bitstreams end with this data, and
+            //CMD_FPGA_CONFIG_END should follow with no data.
+        case CMD_FPGA_CONFIG_SEND_LANES:
+        {
+            uint8_t flags = arg_read_byte();
+
+            while (arg_remaining() >= JTAG_LANES)
+            {
+                uint8_t data[JTAG_LANES];
+
+                arg_read(data, JTAG_LANES);
+                fpga_send_config_lanes(data, (flags & CONFIG_LANES_LAST) && arg_remaining() < JTAG_LANES);
+            }
+
+            break;
+        }
+
+#ifdef FLASH_IMAGE
+
+            //Configure the FPGA from the compressed bitstream image in flash.
+            //
+            //The image is written beforehand with flash page writes; see image.h. The
+            //FPGA's final status is recorded, as for CMD_FPGA_CONFIG_END.
+        case CMD_FPGA_CONFIG_IMAGE:
+            CommandError = image_configure_fpga();
+            break;
+
+#endif
+
+#ifdef FPGA_READBACK
+
+            //Verify the FPGA's configuration, by reading it back (see readback.h).
+            //
+            //The argument is the frame address to start at, the number of 32-bit words
+            //to read (including the pad frame), and the number of leading bytes to leave
+            //out of the CRC (32 bits each); optionally followed by the name of a mask
+            //file on the SD card, which holds a byte for each byte of the CRC: the frame
+            //data of bitgen's .msk file, extracted by the host (see readback.h). The reply
+            //is the CRC-32 of the data read.
+        case CMD_FPGA_VERIFY:
+        {
+            uint32_t         address, words, skip, crc = 0;
+            jtag_byte_source mask = 0;
+
+            arg_read(&address, sizeof(address));
+            arg_read(&words, sizeof(words));
+            arg_read(&skip, sizeof(skip));
+
+            if (!words || skip > words * 4)
+            {
+                CommandError = STATUS_ERROR_ARGUMENT;
+                break;
+            }
+
+#ifdef SD_CARD
+            if (arg_remaining() >= SD_NAME_LENGTH)
+            {
+                char    name[SD_NAME_LENGTH];
+                sd_file file;
+
+                arg_read(name, sizeof(name));
+
+                //the card can only be used for one thing at a time
+                cache_capture_abort();
+
+                if (!sd_find(name, &file) || file.size < words * 4 - skip)
+                {
+                    CommandError = STATUS_ERROR_SD;
+                    break;
+                }
+
+                if (!sd_read_start(&file))
+                {
+                    sd_read_stop();
+                    CommandError = STATUS_ERROR_SD;
+                    break;
+                }
+
+                mask = sd_read_next;
+            }
+#else
+            if (arg_remaining())
+            {
+                CommandError = STATUS_ERROR_ARGUMENT;
+                break;
+            }
+#endif
+
+            boundary_sample_stop(NULL);
+
+            if (!readback_verify(address, words, skip, mask, &crc))
+                CommandError = STATUS_ERROR_UNSUPPORTED;
+
+#ifdef SD_CARD
+            if (mask && !sd_read_stop())
+                CommandError = STATUS_ERROR_SD;
+#endif
+
+            set_reply(&crc, sizeof(crc));
+            break;
+        }
+
+            //Snapshot the state of the FPGA's flip-flops (see readback.h).
+            //
+            //The argument is the length of a frame in 32-bit words (16 bits), then up to
+            //READBACK_RANGES ranges of frames: each the frame address of its first frame
+            //(32 bits), and its number of frames (16 bits). The frames' data is streamed
+            //in the following feature reports, range after range, until the snapshot
+            //ends; the whole snapshot should be read before another command is sent.
+        case CMD_FPGA_SNAPSHOT:
+        {
+            readback_range ranges[READBACK_RANGES];
+            uint16_t       frameWords = arg_read_word();
+            uint8_t        count      = 0;
+
+            while (arg_remaining() >= sizeof(uint32_t) + sizeof(uint16_t) && count < READBACK_RANGES)
+            {
+                readback_range* range = &ranges[count++];
+
+                arg_read(&range->address, sizeof(range->address));
+                arg_read(&range->frames, sizeof(range->frames));
+
+                //each range is read back with its pad frame, in a single packet
+                if (!range->frames || (range->frames + 1UL) * frameWords > BITSTREAM_TYPE_2_MAX)
+                    CommandError = STATUS_ERROR_ARGUMENT;
+            }
+
+            if (!frameWords || !count || arg_remaining())
+                CommandError = STATUS_ERROR_ARGUMENT;
+
+            if (CommandError == STATUS_OK)
+            {
+                //stop polling the console and capturing boundary snapshots, which
+                //would disturb the readback
+                console_set_enabled(false);
+                boundary_sample_stop(NULL);
+
+                if (readback_snapshot_start(frameWords, ranges, count))
+                {
+                    set_reply_stream(readback_snapshot_read);
+                    break;
+                }
+
+                CommandError = STATUS_ERROR_UNSUPPORTED;
+            }
+
+            set_reply(NULL, 0);
+            break;
+        }
+
+#endif
+
+            //Read the FPGA's status.
+            //
+            //The FPGA's DONE and INIT_B state are read over JTAG, and reported in the
+            //status report. The reply is the status, followed by the wait times of the
+            //last configuration (an fpga_config_timing).
+        case CMD_FPGA_STATUS:
+        {
+            uint8_t reply[1 + sizeof(fpga_config_timing)];
+
+            //reading the status loads BYPASS, which ends any boundary-scan capture
+            boundary_sample_stop(NULL);
+            CommandStatus.FpgaStatus = fpga_get_status();
+
+            reply[0] = CommandStatus.FpgaStatus;
+            memcpy(&reply[1], &fpga_timing, sizeof(fpga_config_timing));
+
+            set_reply(reply, sizeof(reply));
+            break;
+        }
+
+            //Select the USER register used for data transfers with the FPGA.
+            //
+            //The argument is the USER register number (1 or 2). The instruction stays
+            //loaded, so any number of transfers can follow without reselecting it.
+        case CMD_FPGA_USER_SELECT:
+            boundary_sample_stop(NULL);
+            fpga_user_select(arg_read_byte());
+            break;
+
+            //Write to the selected USER register.
+            //
+            //The argument is a flags byte (USER_SCAN_FIRST starts a new DR scan, and
+            //USER_SCAN_LAST ends the scan after this data), a length byte, and then up to
+            //255 bytes of data. Large transfers can span as many packets as needed.
+        case CMD_FPGA_USER_WRITE:
+        {
+            uint8_t flags  = arg_read_byte();
+            uint8_t length = arg_read_byte();
+
+            //boundary-scan capture would scan through the USER register
+            boundary_sample_stop(NULL);
+
+            if (length > arg_remaining())
+                length = arg_remaining();
+
+            for (uint8_t byteNo = 0; byteNo < length; ++byteNo)
+            {
+                bool first = (flags & USER_SCAN_FIRST) && (byteNo == 0);
+                bool last  = (flags & USER_SCAN_LAST) && (byteNo == length - 1);
+
+                fpga_user_shift((char) arg_read_byte(), first, last);
+            }
+            break;
+        }
+
+            //Read from the selected USER register.
+            //
+            //The argument is a flags byte (as for CMD_FPGA_USER_WRITE) and a 16-bit
+            //length. The data is shifted out as the host requests it, one feature
+            //report at a time, so reads can be as long as needed.
+        case CMD_FPGA_USER_READ:
+            boundary_sample_stop(NULL);
+
+            userRead.Flags     = arg_read_byte();
+            userRead.Remaining = arg_read_word();
+            userRead.Started   = false;
+
+            set_reply_stream(user_read_source);
+            break;
+
+#ifdef BOUNDARY_SCAN
+
+            //Start capturing boundary-scan snapshots of the FPGA's pins.
+            //
+            //The argument is the first boundary cell to capture (cell zero is nearest TDO),
+            //and the number of cells to capture; both 16 bits. The snapshots are streamed in
+            //the following feature reports; each holds a byte count, then that many bytes of
+            //snapshot data. Each snapshot is a 16-bit Timer1 timestamp, then the cells.
+        case CMD_BOUNDARY_SAMPLE_START:
+        {
+            uint16_t firstBit = arg_read_word();
+            uint16_t bits     = arg_read_word();
+
+            //stop polling the console, which would disturb the loaded instruction
+            console_set_enabled(false);
+
+            if (boundary_sample_start(firstBit, bits))
+                set_reply_stream(boundary_sample_source);
+            else
+            {
+                CommandError = STATUS_ERROR_ARGUMENT;
+                set_reply(NULL, 0);
+            }
+
+            break;
+        }
+
+            //Stop capturing boundary-scan snapshots.
+            //
+            //The reply is the number of snapshots captured, the capture time in Timer1
+            //ticks, and the capture rate in snapshots per second; all 32 bits.
+        case CMD_BOUNDARY_SAMPLE_STOP:
+        {
+            boundary_sample_stats stats;
+
+            boundary_sample_stop(&stats);
+            set_reply(&stats, sizeof(stats));
+            break;
+        }
+
+            //Load part of the EXTEST safe vector.
+            //
+            //The argument is the boundary register length in bits (16 bits), the byte offset
+            //of this data into the vector, its length in bytes, and then the data. The reply
+            //is a single byte; nonzero if the data was accepted.
+        case CMD_EXTEST_VECTOR:
+        {
+            uint8_t  vector[BYTES_PER_PACKET - 4];
+            uint16_t bits   = arg_read_word();
+            uint8_t  offset = arg_read_byte();
+            uint8_t  length = arg_read_byte();
+            bool     accepted = false;
+
+            //the vector shares its memory with the snapshot ring
+            boundary_sample_stop(NULL);
+
+            if (length <= sizeof(vector))
+            {
+                arg_read(vector, length);
+                accepted = extest_set_vector(bits, offset, length, vector);
+            }
+
+            if (!accepted)
+                CommandError = STATUS_ERROR_ARGUMENT;
+
+            set_reply(&accepted, sizeof(accepted));
+            break;
+        }
+
+            //Describe some of the nets under EXTEST.
+            //
+            //The argument is the index of the first net described, the number of nets, and
+            //then an extest_net entry (output, control and input cells; 16 bits each) for
+            //each. The reply is a single byte; nonzero if the nets were accepted. Nets with a
+            //cell beyond BOUNDARY_MAX_BITS are refused, with STATUS_ERROR_ARGUMENT.
+        case CMD_EXTEST_NETS:
+        {
+            extest_net nets[(BYTES_PER_PACKET - 2) / sizeof(extest_net)];
+            uint8_t    first = arg_read_byte();
+            uint8_t    count = arg_read_byte();
+            bool       accepted = false;
+
+            boundary_sample_stop(NULL);
+
+            if (count <= sizeof(nets) / sizeof(extest_net))
+            {
+                arg_read(nets, count * sizeof(extest_net));
+                accepted = extest_set_nets(first, count, nets);
+            }
+
+            if (!accepted)
+                CommandError = STATUS_ERROR_ARGUMENT;
+
+            set_reply(&accepted, sizeof(accepted));
+            break;
+        }
+
+            //Run an interconnect test.
+            //
+            //The argument is the pattern type (an EXTEST_ constant). The reply is the number
+            //of nets which failed, followed by a bitmap of the failed nets. Fails with
+            //STATUS_ERROR_ARGUMENT, testing nothing, if the safe vector or the nets haven't
+            //been set (or a boundary-scan capture has since overwritten the vector), or if a
+            //net has a cell beyond the end of the vector.
+        case CMD_EXTEST_RUN:
+        {
+            uint8_t result[1 + EXTEST_MAX_NETS / 8];
+
+            //stop polling the console, which would disturb the loaded instruction
+            console_set_enabled(false);
+            boundary_sample_stop(NULL);
+
+            if (!extest_run(arg_read_byte(), &result[1], &result[0]))
+                CommandError = STATUS_ERROR_ARGUMENT;
+
+            set_reply(result, sizeof(result));
+            break;
+        }
+
+#endif
+
+#ifdef JTAG_CONSOLE
+
+            //Start or stop the JTAG virtual console.
+            //
+            //The argument is a single byte; nonzero to start polling the console mailbox.
+            //While the console runs, each IN report carries IN_REPORT_CONSOLE, a character
+            //count, and up to six characters.
+        case CMD_CONSOLE_ENABLE:
+        {
+            bool enabled = arg_read_byte();
+
+            //the console's polls load USER2, which ends boundary-scan capture
+            if (enabled)
+                boundary_sample_stop(NULL);
+
+            console_set_enabled(enabled);
+            break;
+        }
+
+#endif
+
+#ifdef SD_CARD
+
+            //List the files on the SD card.
+            //
+            //The reply is streamed: an sd_list_entry (name and size) for each file
+            //in the card's root directory. The card is reinitialized first, in case
+            //it's been replaced.
+        case CMD_SD_LIST:
+            cache_capture_abort();
+            sd_unmount();
+            sd_list_start();
+            set_reply_stream(sd_list_read);
+            break;
+
+            //Configure the FPGA from a file on the SD card.
+            //
+            //The argument is the file's name. The FPGA's final status is recorded, as
+            //for CMD_FPGA_CONFIG_END.
+        case CMD_SD_CONFIG:
+        {
+            char    name[SD_NAME_LENGTH];
+            sd_file file;
+
+            arg_read(name, sizeof(name));
+
+            if (sd_find(name, &file))
+                CommandError = sd_configure_fpga(&file, file.size, BITSTREAM_FILE);
+            else
+                CommandError = STATUS_ERROR_SD;
+
+            break;
+        }
+
+            //Set the boot file, from which the FPGA is configured at power-up.
+            //
+            //The argument is the file's name; a name of zeroes disables booting from
+            //the card, and an empty argument leaves the boot file unchanged. The reply
+            //is the boot file's name.
+        case CMD_SD_BOOT_FILE:
+        {
+            char name[SD_NAME_LENGTH];
+
+            if (arg_remaining() >= sizeof(name))
+            {
+                arg_read(name, sizeof(name));
+                sd_set_boot_name(name);
+            }
+
+            sd_get_boot_name(name);
+            set_reply(name, sizeof(name));
+            break;
+        }
+
+            //Look a bitstream up in the SD card's cache (see cache.h).
+            //
+            //The argument is the bitstream's CRC-32 and length (32 bits each). On a
+            //hit, the FPGA is configured from the cache, as by CMD_SD_CONFIG. On a
+            //miss, the host should upload the bitstream as usual, and it's added to
+            //the cache as it's configured. The reply is a cache_lookup_reply.
+        case CMD_CACHE_LOOKUP:
+        {
+            cache_lookup_reply Reply;
+            sd_file            file;
+            uint32_t           crc, length;
+            uint8_t            format;
+
+            arg_read(&crc, sizeof(crc));
+            arg_read(&length, sizeof(length));
+
+            Reply.Hit = cache_lookup(crc, length, &file, &Reply.Slot, &format);
+
+            if (Reply.Hit)
+                CommandError = sd_configure_fpga(&file, length, format);
+
+            set_reply(&Reply, sizeof(Reply));
+            break;
+        }
+
+#endif
+
+#ifdef SPI_FLASH
+
+            //Read the JEDEC ID of the SPI flash, through the JTAG-SPI bridge.
+            //
+            //The bridge design should be loaded first (see spiflash.h); it takes over
+            //the chain's USER1 register, so each of the SPI flash commands stops the
+            //console. The reply is the SPIFLASH_ID_LENGTH bytes of the ID.
+        case CMD_SPI_FLASH_ID:
+        {
+            uint8_t id[SPIFLASH_ID_LENGTH] = { 0 };
+
+            console_set_enabled(false);
+            boundary_sample_stop(NULL);
+
+            CommandError = spiflash_error(spiflash_read_id(id));
+            set_reply(id, sizeof(id));
+            break;
+        }
+
+            //Compute the CRC-32 of part of the SPI flash.
+            //
+            //The argument is the address and length (32 bits each). The reply is the
+            //CRC-32; the host compares it with that of the data it would write, and
+            //leaves the sector alone if they match.
+        case CMD_SPI_FLASH_CRC:
+        {
+            uint32_t address, length, crc = 0;
+
+            arg_read(&address, sizeof(address));
+            arg_read(&length, sizeof(length));
+
+            console_set_enabled(false);
+            boundary_sample_stop(NULL);
+
+            CommandError = spiflash_error(spiflash_crc(address, length, &crc));
+            set_reply(&crc, sizeof(crc));
+            break;
+        }
+
+            //Erase a sector of the SPI flash, unless it's already blank.
+            //
+            //The argument is the erase command for the sector size (such as
+            //SPIFLASH_ERASE_64K), then the sector's address and length (32 bits each).
+            //The reply is a single byte; nonzero if the sector needed erasing.
+        case CMD_SPI_FLASH_ERASE:
+        {
+            uint8_t  command = arg_read_byte();
+            uint32_t address, length;
+            bool     erased = false;
+
+            arg_read(&address, sizeof(address));
+            arg_read(&length, sizeof(length));
+
+            console_set_enabled(false);
+            boundary_sample_stop(NULL);
+
+            CommandError = spiflash_error(spiflash_erase(command, address, length, &erased));
+            set_reply(&erased, sizeof(erased));
+            break;
+        }
+
+            //Program erased SPI flash.
+            //
+            //The argument is the address to start at (32 bits), then the data; each page
+            //is programmed, and the flash's status polled until it's written, before the
+            //next is sent, so a whole sector can be sent as a single command.
+        case CMD_SPI_FLASH_PROGRAM:
+        {
+            uint32_t address;
+
+            arg_read(&address, sizeof(address));
+
+            console_set_enabled(false);
+            boundary_sample_stop(NULL);
+
+            CommandError = spiflash_error(spiflash_program(address, arg_read_byte, arg_remaining()));
+
+            //discard any data which wasn't programmed
+            while (arg_remaining())
+                arg_read_byte();
+
+            break;
+        }
+
+#endif
+
+        //Write to flash: the command word is the address of the page to be written.
+        //Arguments longer than a page are written to consecutive pages.
+        default:
+
+            //commands which aren't built in (see unilab.h) are unsupported, rather than bad addresses
+            if (PageAddress >= CMD_HARD_RESET)
+            {
+                CommandError = STATUS_ERROR_UNSUPPORTED;
+                break;
+            }
+
+            do
+            {
+                //If the address to be written is beyond the end of user memory,
+                //ignore the instruction
+                if (PageAddress >= BOOTLOADER_START)
+                {
+                    CommandError = STATUS_ERROR_ADDRESS;
+                    break;
+                }
+
+                /* Erase the given FLASH page, ready to be programmed */
+                boot_page_erase(PageAddress);
+                spm_busy_wait();
+
+                /* Write each of the FLASH page's bytes in sequence */
+                for (uint8_t PageByte = 0; PageByte < SPM_PAGESIZE; PageByte += 2)
+                {
+                    /* Write the next data word to the FLASH page */
+                    boot_page_fill(PageAddress + PageByte, arg_read_word());
+                }
+
+                /* Write the filled FLASH page to memory */
+                boot_page_write(PageAddress);
+                spm_busy_wait();
+
+                /* Re-enable RWW section */
+                boot_rww_enable();
+
+                PageAddress += SPM_PAGESIZE;
+            }
+            while (arg_remaining());
+
+            break;
+    }
+
+}
+
+/**
+ * Executes a single command, whose argument readers have been set up, and records its result.
+ */
+static void run_command(uint16_t Command)
+{
+    ExecutorRunning = true;
+
+    CommandError = STATUS_OK;
+    execute_command(Command);
+
+    //discard any part of the argument the command didn't use
+    while (arg_remaining())
+        arg_read_byte();
+
+    //record the command's result, for the status report
+    CommandStatus.Error = CommandError;
+    ++CommandStatus.Completed;
+
+    ExecutorRunning = false;
+}
+
+/**
+ * Executes a command whose argument is too long for a queue slot, from inside its control
+ * request; the argument is read from the control endpoint as the command consumes it.
+ * Only called once the queue is empty, so commands still execute in order.
+ */
+static void execute_streamed(uint16_t Command, uint16_t Length)
+{
+    InControlRequest = true;
+
+    ++CommandStatus.Received;
+
+    ArgumentStreamed  = true;
+    ArgumentRemaining = Length;
+
+    run_command(Command);
+
+    InControlRequest = false;
+}
+
+/**
+ * Receives a command from the control endpoint, once its SET_REPORT request has been
+ * set up: queues it, or executes it as it arrives if its argument is too long for a
+ * queue slot.
+ *
+ * length: The length of the request's data (its wLength).
+ */
+static void receive_command(uint16_t length)
+{
+    command_slot* command = &CommandQueue[(CommandHead + CommandCount) % COMMAND_QUEUE_SLOTS];
+    uint16_t      remaining = length;
+    uint32_t      start;
+    uint16_t      commandWord;
+
+    /* Wait until the command has been sent by the host */
+    start = stats_now();
+    while (!(Endpoint_IsOUTReceived()));
+    stats_add(STATS_USB_WAIT, start);
+
+    //speed up after the first packet has been received
+    //TODO: unspeed (i.e. slow) after idle
+    blinkOn = blinkOff = 1600;
+
+    /* Read in the command (or write destination address) */
+    commandWord = Endpoint_Read_Word_LE();
+    remaining   = (remaining > 2) ? remaining - 2 : 0;
+
+    stats_add_bytes(length);
+
+    /* If the argument is too long for a queue slot, execute the command as it arrives */
+    if (remaining > sizeof(command->Argument))
+    {
+        execute_streamed(commandWord, remaining);
+
+        Endpoint_ClearOUT();
+        Endpoint_ClearStatusStage();
+        return;
+    }
+
+    /* Otherwise, read in the command's argument */
+    command->Command = commandWord;
+    command->Length  = 0;
+
+    while (remaining--)
+        command->Argument[command->Length++] = endpoint_read_byte();
+
+    //acknowledge the command, and queue it for execution
+    Endpoint_ClearOUT();
+    Endpoint_ClearStatusStage();
+
+    ++CommandCount;
+    ++CommandStatus.Received;
+}
+
+/**
+ * Executes the command at the head of the queue, if there is one.
+ * Should be called from the main loop.
+ */
+void executor_task(void)
+{
+    if (ExecutorRunning || !CommandCount)
+        return;
+
+    //point the argument readers at the command's argument
+    CurrentCommand    = &CommandQueue[CommandHead];
+    ArgumentPosition  = 0;
+    ArgumentStreamed  = false;
+    ArgumentRemaining = CurrentCommand->Length;
+
+    run_command(CurrentCommand->Command);
+
+    //and release its slot
+    CommandHead = (CommandHead + 1) % COMMAND_QUEUE_SLOTS;
+    --CommandCount;
+}
+
+/**
+ * Called periodically during long operations (JTAG run-test waits and flash writes),
+ * so that USB is serviced while they run. New commands can be queued meanwhile, but
+ * are executed only once the current command completes.
+ */
+void executor_yield(void)
+{
+    //USB can't be serviced from inside a control request
+    if (InControlRequest)
+        return;
+
+    blink_led();
+    service_usb();
+}
+
+/**
+ * Services the USB interface. Control requests are only processed while there's room
+ * in the queue for another command; until then, the host's next request waits. Requests
+ * are processed while a command executes, too (from executor_yield); a command with a long
+ * argument is then refused (see EVENT_USB_Device_UnhandledControlRequest).
+ */
+void service_usb(void)
+{
+    HID_Device_USBTask(&Generic_HID_Interface);
+
+    if (CommandCount < COMMAND_QUEUE_SLOTS)
+        USB_USBTask();
+}
+
+/** Event handler for the USB_UnhandledControlRequest event. This is used to catch standard and class specific
+ *  control requests that are not handled internally by the USB library (including the HID commands, which are
+ *  all issued via the control endpoint), so that they can be handled appropriately for the application.
+ *
+ *  Commands are usually only received and queued here; they're acknowledged immediately, and executed from the
+ *  main loop by executor_task. Commands whose argument is too long for a queue slot are instead executed here,
+ *  as their argument arrives, and acknowledged once complete. If other commands are queued or executing, such a
+ *  command is refused at once, by stalling its request, as it couldn't be received until they complete (which
+ *  may take longer than the host's control transfer timeout). The host should resend it once the status report
+ *  no longer shows STATUS_BUSY.
+ */
+void EVENT_USB_Device_UnhandledControlRequest(void)
+{
+    //once we're attached via USB, stop blinking
+    blinkOn = 1000;
+    blinkOff = 1;
+
+    /* Handle HID Class specific requests */
+    if (USB_ControlRequest.bRequest == REQ_SetReport)
+    {
+        //Once communications have started, speed up our LED blink.
+        connectionMade = true;
+
+        /* A command with a long argument can't be received until the commands before it complete */
+        if (USB_ControlRequest.wLength > 2 + sizeof(CommandQueue[0].Argument) && (ExecutorRunning || CommandCount))
+        {
+            Endpoint_StallTransaction();
+            Endpoint_ClearSETUP();
+            return;
+        }
+
+        Endpoint_ClearSETUP();
+        receive_command(USB_ControlRequest.wLength);
+    }
+}
@@ -49,7 +49,18 @@
 		#include <avr/interrupt.h>
 
                 #include "unilab.h"
+                #include "clock.h"
+                #include "console.h"
+                #include "stats.h"
+                #include "bench.h"
+                #include "sd.h"
+                #include "cache.h"
+                #include "image.h"
+                #include "readback.h"
+                #include "spiflash.h"
                 #include "jtag/fpga.h"
+                #include "jtag/bitstream.h"
+                #include "jtag/boundary.h"
 
 		#include "Descriptors.h"
 
@@ -74,6 +85,12 @@
 	/** HID Class specific request to send the next HID report to the device. */
 	#define REQ_SetReport             0x09
 
+	/** HID Class specific request to retrieve a HID report from the device. */
+	#define REQ_GetReport             0x01
+
+	/** HID report type of feature reports, as given in the high byte of wValue. */
+	#define REPORT_TYPE_Feature       0x03
+
 
 
 
@@ -83,6 +100,89 @@
 	#define WORDS_PER_PACKET	64
 	#define BYTES_PER_PACKET	WORDS_PER_PACKET * 2
 
+	/**
+	 * Largest command argument: a control transfer carries up to 64KB, including
+	 * the command word. Arguments which don't fit in a queue slot (BYTES_PER_PACKET)
+	 * are streamed straight from the control endpoint as the command executes.
+	 */
+	#define MAX_ARGUMENT_SIZE	(0xFFFF - 2)
+
+	/**
+	 * Largest block of an argument handled at once by the block readers; one
+	 * control endpoint packet.
+	 */
+	#define ARGUMENT_BLOCK_SIZE	FIXED_CONTROL_ENDPOINT_SIZE
+
+	//Number of commands which can be queued for execution; while one command executes,
+	//the next can be received.
+	#define COMMAND_QUEUE_SLOTS	2
+
+
+	/**
+	 * Version of the command protocol, as reported by CMD_WHOAMI.
+	 * Increment whenever existing commands change; new commands are
+	 * advertised with FEATURE_ flags.
+	 */
+	#define PROTOCOL_VERSION	0x01
+
+	/**
+	 * Feature flags, as reported by CMD_WHOAMI. Most depend on the optional
+	 * features built in (see unilab.h).
+	 */
+	#define FEATURE_CLOCK_OUT	0x0001	/* CMD_SET_CLOCK_OUT */
+	#define FEATURE_REPLY_STREAM	0x0002	/* streamed (multi-report) replies */
+	#define FEATURE_FPGA_CONFIG	0x0004	/* FPGA configuration over JTAG */
+	#define FEATURE_FPGA_USER	0x0008	/* USER register transfers */
+	#define FEATURE_CONSOLE		0x0010	/* soft-core console mailbox */
+	#define FEATURE_BOUNDARY_SCAN	0x0020	/* SAMPLE capture and EXTEST */
+	#define FEATURE_COMPRESSION	0x0080	/* compressed bitstream image in flash (see image.h) */
+	#define FEATURE_SPI_JTAG	0x0100	/* SPI flash access through the FPGA */
+	#define FEATURE_STATS		0x0200	/* CMD_STATS performance counters */
+	#define FEATURE_BENCH		0x0400	/* CMD_BENCH self-benchmark */
+	#define FEATURE_JTAG_TRACE	0x0800	/* CMD_JTAG_TRACE recorder (JTAG_TRACE builds) */
+	#define FEATURE_JTAG_LANES	0x1000	/* multiple JTAG lanes (see CMD_JTAG_LANES) */
+	#define FEATURE_SD_CARD		0x2000	/* SD card bitstream store (SD_CARD builds) */
+	#define FEATURE_CACHE		0x4000	/* CMD_CACHE_LOOKUP bitstream cache (SD_CARD builds) */
+	#define FEATURE_CONFIG_FILE	0x8000	/* CMD_FPGA_CONFIG_FILE, and bitstream checks */
+
+	/**
+	 * Frequency of the status timer (Timer1), in Hz.
+	 */
+	#define STATUS_TIMER_HZ		15625UL
+
+	/**
+	 * Number of TCK cycles timed to estimate the TCK rate, at startup.
+	 */
+	#define TCK_MEASURE_CLOCKS	4096
+
+	/**
+	 * IN report types, given in the first byte of IN reports generated by the device
+	 * (as opposed to echoes of the host's last report).
+	 */
+	#define IN_REPORT_CONSOLE	0x01
+	#define IN_REPORT_STATUS	0x02
+
+	/**
+	 * Status report flags.
+	 */
+	#define STATUS_BUSY		0x01	/* commands are queued or executing */
+
+	/**
+	 * Command error codes, as given in status reports.
+	 */
+	#define STATUS_OK		0x00
+	#define STATUS_ERROR_ARGUMENT	0x01	/* the command's argument was invalid */
+	#define STATUS_ERROR_ADDRESS	0x02	/* the flash address is outside of user memory */
+	#define STATUS_ERROR_CONFIG	0x03	/* the FPGA didn't start after configuration */
+	#define STATUS_ERROR_TIMEOUT	0x04	/* the FPGA or SPI flash didn't become ready in time */
+	#define STATUS_ERROR_SD		0x05	/* the SD card or file couldn't be read */
+	#define STATUS_ERROR_IMAGE	0x06	/* no complete bitstream image is stored in flash */
+	#define STATUS_ERROR_FILE	0x07	/* the configuration file or bitstream was empty or cut short */
+	#define STATUS_ERROR_DEVICE	0x08	/* the bitstream is for a different FPGA */
+	#define STATUS_ERROR_PACKET	0x09	/* the bitstream held an invalid configuration packet */
+	#define STATUS_ERROR_UNSUPPORTED	0x0A	/* the FPGA (or this build) doesn't support the operation */
+	#define STATUS_ERROR_BRIDGE	0x0B	/* the FPGA isn't configured, so holds no JTAG-SPI bridge */
+
 
 	/**
 	 * Bootloader commands.
@@ -98,11 +198,32 @@
 	//'Soft reset' the microprocessor.
 	#define CMD_SOFT_RESET 0xF001
 
-	//Request the device sends identification.
+	//Request the device sends identification; the reply is a whoami_reply.
 	#define CMD_WHOAMI	0xF002
 
         //Request a change in the bootloader clock (the clock sent to the FPGA).
-        #define CMD_SET_CLOCK_OUT
+        #define CMD_SET_CLOCK_OUT 0xF003
+
+        //Read the performance counters; the reply is a stats_report.
+        #define CMD_STATS 0xF004
+
+        //Flags for CMD_STATS.
+        #define STATS_READ_RESET 0x01	/* reset the counters after reading them */
+
+        //Run a self-benchmark; see bench.h. For the USB modes, the data is then
+        //sent with CMD_BENCH_DATA or read as the reply, and the result read with
+        //CMD_BENCH_RESULT. The other modes reply with their bench_result.
+        #define CMD_BENCH        0xF005
+        #define CMD_BENCH_DATA   0xF006
+        #define CMD_BENCH_RESULT 0xF007
+
+        //Dump the JTAG trace (see jtag/core.h); the reply is streamed, as a
+        //series of jtag_trace_entry records, oldest first.
+        #define CMD_JTAG_TRACE   0xF008
+
+        //Select the JTAG lanes to drive, on boards with several; the reply is
+        //the number of lanes the board has.
+        #define CMD_JTAG_LANES   0xF009
 
 	//Basys2 board commands
         #if defined(UNILAB_BASYS_100K) || defined(UNILAB_BASYS_250K) || defined(UNILAB_MARK1)
@@ -113,11 +234,102 @@
 			#define CMD_FPGA_CONFIG_START 0xF022
 			#define CMD_FPGA_CONFIG_SEND  0xF023
 			#define CMD_FPGA_CONFIG_END   0xF024
+			#define CMD_FPGA_STATUS       0xF025
+			#define CMD_FPGA_CONFIG_SEND_LANES 0xF026
+			#define CMD_FPGA_CONFIG_IMAGE 0xF027
+			#define CMD_FPGA_CONFIG_FILE  0xF028
+			#define CMD_FPGA_VERIFY       0xF029
+			#define CMD_FPGA_SNAPSHOT     0xF02A
+
+			//Flags for CMD_FPGA_CONFIG_SEND_LANES.
+			#define CONFIG_LANES_LAST     0x01
+
+			#define CMD_FPGA_USER_SELECT  0xF030
+			#define CMD_FPGA_USER_WRITE   0xF031
+			#define CMD_FPGA_USER_READ    0xF032
+
+			//Flags for USER register transfers.
+			#define USER_SCAN_FIRST       0x01
+			#define USER_SCAN_LAST        0x02
+
+			#define CMD_CONSOLE_ENABLE    0xF040
+
+			#define CMD_BOUNDARY_SAMPLE_START 0xF050
+			#define CMD_BOUNDARY_SAMPLE_STOP  0xF051
+
+			#define CMD_EXTEST_VECTOR     0xF058
+			#define CMD_EXTEST_NETS       0xF059
+			#define CMD_EXTEST_RUN        0xF05A
+
+			//SD card bitstream store (SD_CARD builds); files are named by their
+			//SD_NAME_LENGTH-character directory names, e.g. "DESIGN  BIN".
+			#define CMD_SD_LIST           0xF060
+			#define CMD_SD_CONFIG         0xF061
+			#define CMD_SD_BOOT_FILE      0xF062
+			#define CMD_CACHE_LOOKUP      0xF063
+
+			//SPI flash programming through a JTAG-SPI bridge (see spiflash.h).
+			#define CMD_SPI_FLASH_ID      0xF070
+			#define CMD_SPI_FLASH_CRC     0xF071
+			#define CMD_SPI_FLASH_ERASE   0xF072
+			#define CMD_SPI_FLASH_PROGRAM 0xF073
+
+			#define DEVICE_FEATURES (FEATURE_REPLY_STREAM | FEATURE_FPGA_CONFIG | FEATURE_FPGA_USER)
+
+	#else
+
+			#define DEVICE_FEATURES (FEATURE_REPLY_STREAM)
 
 	#endif
 
 
 
+	/* Type Defines: */
+		/** Source function for a streamed reply; fills the buffer with up to size bytes,
+		 *  and returns the number of bytes produced. */
+		typedef uint8_t (*reply_source_t)(uint8_t* buffer, uint8_t size);
+
+		/** Status report, sent on the IN endpoint whenever the device's status changes. */
+		typedef struct
+		{
+			uint8_t Type;       /**< IN_REPORT_STATUS */
+			uint8_t Received;   /**< Sequence number of the last command received (a count, modulo 256) */
+			uint8_t Completed;  /**< Sequence number of the last command completed */
+			uint8_t Flags;      /**< STATUS_ flags */
+			uint8_t Error;      /**< Error code of the last command completed */
+			uint8_t FpgaStatus; /**< FPGA status (FPGA_STATUS_ flags) as of the last check */
+			uint8_t Reserved[2];
+		} status_report;
+
+		/** Device identification, as returned by CMD_WHOAMI. */
+		typedef struct
+		{
+			uint8_t  ProtocolVersion; /**< PROTOCOL_VERSION */
+			uint8_t  BoardModel;      /**< DEVICE_ revision code of the board */
+			uint16_t Features;        /**< FEATURE_ flags */
+			uint16_t MaxTransfer;     /**< Largest command argument, in bytes (MAX_ARGUMENT_SIZE) */
+			uint16_t MaxReply;        /**< Largest single reply (feature report), in bytes */
+			uint16_t PageSize;        /**< Flash page size, in bytes */
+			uint16_t BootloaderStart; /**< First address of the bootloader; user flash ends here */
+			uint32_t TckRate;         /**< Estimated TCK rate, in Hz */
+			uint32_t FpgaIdcode;      /**< IDCODE of the FPGA, as of the last configuration; or zero */
+		} whoami_reply;
+
+		/** Result of a bitstream cache lookup, as returned by CMD_CACHE_LOOKUP. */
+		typedef struct
+		{
+			uint8_t Hit;  /**< Nonzero iff the bitstream was found (and the FPGA configured from it) */
+			uint8_t Slot; /**< Cache entry which holds the bitstream, or will after upload; or CACHE_NONE */
+		} cache_lookup_reply;
+
+		/** A command received from the host, waiting to be executed. */
+		typedef struct
+		{
+			uint16_t Command;
+			uint8_t  Length;
+			uint8_t  Argument[BYTES_PER_PACKET];
+		} command_slot;
+
 	/* Function Prototypes: */
 		void SetupHardware(void);
 
@@ -142,6 +354,13 @@
 
                 void hard_reset(void);
                 void blink_led(void);
+                void set_reply(const void* data, uint8_t size);
+                void set_reply_stream(reply_source_t source);
+                void send_reply(void);
+
+                void executor_task(void);
+                void executor_yield(void);
+                void service_usb(void);
 
 #endif
 
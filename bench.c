@@ -0,0 +1,272 @@
+/**
+ * Self-Benchmark
+ *
+ * USB: the host sends (or reads) a given number of bytes, timed from the start
+ * of the benchmark until the last byte has been transferred; nothing else is
+ * done with the data, so this is the raw rate of the host's USB stack.
+ *
+ * JTAG: a pseudo-random pattern is shifted through the chain with every device
+ * in BYPASS, and compared with the pattern received on TDO, which is delayed by
+ * the bypass registers.
+ *
+ * Flash: the scratch page is erased and written with a test pattern, which is
+ * verified; the page's original contents are restored afterwards.
+ */
+
+#include "bench.h"
+#include "stats.h"
+#include "unilab.h"
+#include "jtag/fpga.h"
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+
+#ifdef SELF_BENCH
+
+//The result of the last benchmark.
+bench_result bench;
+
+//Start time of the running benchmark, and the number of bytes it should transfer.
+static uint32_t bench_start;
+static uint32_t bench_target;
+
+/*
+ * bench_begin / bench_end
+ *
+ * Start and finish timing a benchmark; bench_end computes the rate.
+ */
+static void bench_begin(uint8_t mode, uint32_t bytes)
+{
+	bench.mode = mode;
+	bench.done = false;
+	bench.errors = 0;
+	bench.bytes = 0;
+	bench.cycles = 0;
+	bench.erase_cycles = 0;
+	bench.rate = 0;
+
+	bench_target = bytes;
+	bench_start = stats_now();
+}
+
+static void bench_end(void)
+{
+	uint32_t bytes, ticks;
+
+	bench.cycles = stats_now() - bench_start;
+	bench.done = true;
+
+	//the rate is computed in units of 1024 cycles, scaled down as needed to stay in range
+	bytes = bench.bytes;
+	ticks = bench.cycles >> 10;
+
+	while(bytes > 0x3FFFF)
+	{
+		bytes >>= 1;
+		ticks >>= 1;
+	}
+
+	bench.rate = ticks ? (bytes * (F_CPU >> 10)) / ticks : 0;
+}
+
+/*
+ * bench_pattern
+ *
+ * Returns: the next byte of the test pattern (an 8-bit xorshift sequence).
+ */
+static uint8_t bench_pattern(uint8_t previous)
+{
+	previous ^= previous << 3;
+	previous ^= previous >> 5;
+	previous ^= previous << 1;
+
+	return previous;
+}
+
+/**
+ * bench_usb_start
+ *
+ * Starts a USB benchmark. For BENCH_USB_SINK, the host should then send the
+ * given number of bytes (see bench_usb_sink); for BENCH_USB_SOURCE, it should
+ * read them (see bench_usb_source).
+ */
+void bench_usb_start(uint8_t mode, uint32_t bytes)
+{
+	bench_begin(mode, bytes);
+
+	if(!bytes)
+		bench_end();
+}
+
+/**
+ * bench_usb_sink
+ *
+ * Counts data received for a BENCH_USB_SINK benchmark.
+ */
+void bench_usb_sink(uint16_t bytes)
+{
+	if(bench.mode != BENCH_USB_SINK || bench.done)
+		return;
+
+	bench.bytes += bytes;
+
+	if(bench.bytes >= bench_target)
+		bench_end();
+}
+
+/**
+ * bench_usb_source
+ *
+ * Reply stream source for a BENCH_USB_SOURCE benchmark; fills the buffer with
+ * the next part of the data.
+ *
+ * Returns: the number of bytes produced.
+ */
+uint8_t bench_usb_source(uint8_t* buffer, uint8_t size)
+{
+	if(bench.mode != BENCH_USB_SOURCE || bench.done)
+		return 0;
+
+	if(size > bench_target - bench.bytes)
+		size = bench_target - bench.bytes;
+
+	for(uint8_t i = 0; i < size; ++i)
+		buffer[i] = i;
+
+	bench.bytes += size;
+
+	if(bench.bytes >= bench_target)
+		bench_end();
+
+	return size;
+}
+
+/**
+ * bench_jtag
+ *
+ * Shifts a number of bytes through the chain in BYPASS, checking the data
+ * received on TDO. The chain is left in BYPASS.
+ */
+void bench_jtag(uint32_t bytes)
+{
+	uint8_t sent = 0x5A, previous = 0;
+
+	bench_begin(BENCH_JTAG, bytes);
+
+	if(bytes)
+	{
+		//place the FPGA in BYPASS (the PROM always is)
+		fpga_get_status();
+
+		for(uint32_t i = 0; i < bytes; ++i)
+		{
+			uint8_t received = jtag_shift_data(sent, 8, i == 0, i == bytes - 1);
+
+			//each bit arrives BENCH_BYPASS_DELAY bits after it was sent
+			if(received != (uint8_t)((sent << BENCH_BYPASS_DELAY) | (previous >> (8 - BENCH_BYPASS_DELAY))))
+				++bench.errors;
+
+			previous = sent;
+			sent = bench_pattern(sent);
+
+			//let the rest of the system run, as a real upload would
+			if(jtag_idle_callback && (i % BENCH_JTAG_IDLE_BYTES) == BENCH_JTAG_IDLE_BYTES - 1)
+				jtag_idle_callback();
+		}
+	}
+
+	bench.bytes = bytes;
+	bench_end();
+}
+
+/*
+ * bench_flash_write
+ *
+ * Erases and writes the scratch page. If data is null, the test pattern
+ * starting at seed is written instead.
+ *
+ * Returns: the time spent erasing, in cycles.
+ */
+static uint32_t bench_flash_write(const uint8_t* data, uint8_t seed)
+{
+	uint32_t start = stats_now();
+	uint32_t erase_cycles;
+
+	boot_page_erase(BENCH_FLASH_PAGE);
+	boot_spm_busy_wait();
+
+	erase_cycles = stats_now() - start;
+
+	for(uint16_t i = 0; i < SPM_PAGESIZE; i += 2)
+	{
+		uint8_t low, high;
+
+		if(data)
+		{
+			low = data[i];
+			high = data[i + 1];
+		}
+		else
+		{
+			low = seed = bench_pattern(seed);
+			high = seed = bench_pattern(seed);
+		}
+
+		boot_page_fill(BENCH_FLASH_PAGE + i, low | ((uint16_t)high << 8));
+	}
+
+	boot_page_write(BENCH_FLASH_PAGE);
+	boot_spm_busy_wait();
+
+	boot_rww_enable();
+
+	return erase_cycles;
+}
+
+/**
+ * bench_flash
+ *
+ * Times a number of erase/write passes on the scratch page, verifying each.
+ */
+void bench_flash(uint8_t passes)
+{
+	uint8_t original[SPM_PAGESIZE];
+	uint8_t seed = 0x5A;
+
+	if(passes > BENCH_FLASH_MAX_PASSES)
+		passes = BENCH_FLASH_MAX_PASSES;
+
+	//save the page, so it can be restored once the benchmark's done
+	for(uint16_t i = 0; i < SPM_PAGESIZE; ++i)
+		original[i] = pgm_read_byte(BENCH_FLASH_PAGE + i);
+
+	bench_begin(BENCH_FLASH, passes * SPM_PAGESIZE);
+
+	for(uint8_t pass = 0; pass < passes; ++pass)
+	{
+		uint8_t expected = seed;
+
+		bench.erase_cycles += bench_flash_write(0, seed);
+
+		//verify the page
+		for(uint16_t i = 0; i < SPM_PAGESIZE; ++i)
+		{
+			expected = bench_pattern(expected);
+
+			if(pgm_read_byte(BENCH_FLASH_PAGE + i) != expected)
+				++bench.errors;
+		}
+
+		seed = expected;
+		bench.bytes += SPM_PAGESIZE;
+	}
+
+	bench_end();
+
+	//and restore the page
+	if(passes)
+		bench_flash_write(original, 0);
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ * Self-Benchmark
+ *
+ * Measures the throughput of each part of an upload in isolation: the USB
+ * link to the host, the JTAG chain, and the MCU's flash. Times are measured in
+ * CPU cycles, with the performance timer (see stats.h). Only built into
+ * SELF_BENCH builds (see unilab.h).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+#include "unilab.h"
+
+//Benchmark modes.
+#define BENCH_USB_SINK		0x00	/* the host sends data, which is discarded */
+#define BENCH_USB_SOURCE	0x01	/* the device streams data to the host */
+#define BENCH_JTAG		0x02	/* a pattern is shifted through the chain in BYPASS */
+#define BENCH_FLASH		0x03	/* a scratch flash page is erased and written */
+
+//Delay of the chain in BYPASS, in bits: the FPGA's and the PROM's bypass registers.
+#define BENCH_BYPASS_DELAY	2
+
+//Number of bytes shifted between calls to the JTAG idle callback.
+#define BENCH_JTAG_IDLE_BYTES	128
+
+//Most erase/write passes a single flash benchmark may make.
+#define BENCH_FLASH_MAX_PASSES	16
+
+//The scratch page used by the flash benchmark: the last page of user memory.
+//Its contents are restored afterwards.
+#define BENCH_FLASH_PAGE	(BOOTLOADER_START - SPM_PAGESIZE)
+
+//Result of a benchmark.
+typedef struct
+{
+	uint8_t mode;		/* BENCH_ mode */
+	bool done;		/* true once the benchmark has finished */
+	uint16_t errors;	/* JTAG: bytes received wrongly; flash: bytes which didn't verify */
+	uint32_t bytes;		/* bytes transferred */
+	uint32_t cycles;	/* total time taken, in CPU cycles */
+	uint32_t erase_cycles;	/* flash: the part of that time spent erasing */
+	uint32_t rate;		/* bytes per second */
+} bench_result;
+
+#ifdef SELF_BENCH
+
+extern bench_result bench;
+
+void bench_usb_start(uint8_t mode, uint32_t bytes);
+void bench_usb_sink(uint16_t bytes);
+uint8_t bench_usb_source(uint8_t* buffer, uint8_t size);
+void bench_jtag(uint32_t bytes);
+void bench_flash(uint8_t passes);
+
+#endif
@@ -0,0 +1,302 @@
+/**
+ * Bitstream Cache
+ *
+ * Each entry's bitstream is kept in its own file, and the index in another;
+ * the index is rewritten whenever an entry is used, so entries' ages survive
+ * power cycles. An entry is cleared from the index before its file is
+ * overwritten, and only set again once the upload's CRC and length have been
+ * checked, so an interrupted upload can never be mistaken for a hit.
+ */
+
+#include "cache.h"
+
+#ifdef SD_CARD
+
+#include "crc32.h"
+
+#include <string.h>
+
+//Names of the index, and of the first entry's file; the digit is replaced by
+//the entry's number.
+static const char cache_index_name[SD_NAME_LENGTH] = "CACHE   IDX";
+static const char cache_slot_name[SD_NAME_LENGTH] = "CACHE0  BIN";
+#define CACHE_SLOT_DIGIT	5
+
+//The upload being copied into the cache, if any.
+static struct
+{
+	bool armed;		/* the next upload should be copied */
+	bool capturing;		/* an upload is being copied */
+	uint8_t slot;
+	uint8_t format;
+	uint32_t crc;		/* as expected */
+	uint32_t length;
+	uint32_t received_crc;	/* as received so far */
+	uint32_t received_length;
+} cache_upload;
+
+/*
+ * cache_slot_file
+ *
+ * Finds an entry's file.
+ */
+static bool cache_slot_file(uint8_t slot, sd_file* file)
+{
+	char name[SD_NAME_LENGTH];
+
+	memcpy(name, cache_slot_name, SD_NAME_LENGTH);
+	name[CACHE_SLOT_DIGIT] += slot;
+
+	return sd_find(name, file);
+}
+
+/*
+ * cache_read_index
+ *
+ * Reads the index; a new card's index, or one in an older layout (neither of
+ * which has CACHE_MAGIC), is read as empty.
+ *
+ * file:	Receives the index file.
+ */
+static bool cache_read_index(cache_index* index, sd_file* file)
+{
+	uint8_t* data = (uint8_t*)index;
+
+	if(!sd_find(cache_index_name, file) || file->size < sizeof(cache_index))
+		return false;
+
+	if(sd_read_start(file))
+		for(uint8_t i = 0; i < sizeof(cache_index); ++i)
+			data[i] = sd_read_next();
+
+	if(!sd_read_stop())
+		return false;
+
+	if(index->magic != CACHE_MAGIC)
+	{
+		memset(index, 0, sizeof(cache_index));
+		index->magic = CACHE_MAGIC;
+	}
+
+	return true;
+}
+
+static bool cache_write_index(const cache_index* index, const sd_file* file)
+{
+	if(sd_write_start(file))
+		sd_write_block((const uint8_t*)index, sizeof(cache_index));
+
+	return sd_write_stop();
+}
+
+/*
+ * cache_newest
+ *
+ * Returns: The time of the most recent use of any entry.
+ */
+static uint32_t cache_newest(const cache_index* index)
+{
+	uint32_t newest = 0;
+
+	for(uint8_t slot = 0; slot < CACHE_SLOTS; ++slot)
+		if(index->entries[slot].used > newest)
+			newest = index->entries[slot].used;
+
+	return newest;
+}
+
+/**
+ * cache_lookup
+ *
+ * Looks a bitstream up in the cache. On a miss, an entry is chosen to hold the
+ * bitstream (an empty one, or else the least recently used), and the next
+ * upload is copied into it; see cache_capture_start.
+ *
+ * crc:		The bitstream's CRC-32.
+ * length:	The bitstream's length, in bytes.
+ * file:	On a hit, receives the file holding the bitstream (which may be
+ * 			longer than the bitstream).
+ * slot:	Receives the entry which holds the bitstream; or, on a miss, the
+ * 			entry which will; or CACHE_NONE if the bitstream can't be cached.
+ * format:	On a hit, receives the format in which the bitstream was uploaded.
+ *
+ * Returns: True iff the bitstream is in the cache.
+ */
+bool cache_lookup(uint32_t crc, uint32_t length, sd_file* file, uint8_t* slot, uint8_t* format)
+{
+	cache_index index;
+	sd_file index_file;
+	uint8_t victim = CACHE_NONE;
+
+	cache_capture_abort();
+	cache_upload.armed = false;
+	*slot = CACHE_NONE;
+
+	if(!length || !cache_read_index(&index, &index_file))
+		return false;
+
+	for(uint8_t i = 0; i < CACHE_SLOTS; ++i)
+	{
+		cache_entry* entry = &index.entries[i];
+
+		if(entry->length == length && entry->crc == crc && cache_slot_file(i, file) && file->size >= length)
+		{
+			//mark the entry as the most recently used
+			entry->used = cache_newest(&index) + 1;
+			cache_write_index(&index, &index_file);
+
+			*slot = i;
+			*format = entry->format;
+			return true;
+		}
+	}
+
+	//otherwise, find the least recently used entry big enough for the bitstream;
+	//empty entries were never used, so are chosen first
+	for(uint8_t i = 0; i < CACHE_SLOTS; ++i)
+	{
+		if(!cache_slot_file(i, file) || file->size < length)
+			continue;
+
+		if(victim == CACHE_NONE || index.entries[i].used < index.entries[victim].used)
+			victim = i;
+	}
+
+	if(victim == CACHE_NONE)
+		return false;
+
+	//clear the entry before its file is overwritten
+	memset(&index.entries[victim], 0, sizeof(cache_entry));
+
+	if(!cache_write_index(&index, &index_file))
+		return false;
+
+	cache_upload.armed = true;
+	cache_upload.slot = victim;
+	cache_upload.crc = crc;
+	cache_upload.length = length;
+
+	*slot = victim;
+	return false;
+}
+
+/**
+ * cache_capture_start
+ *
+ * Starts copying an upload into the cache, if the last lookup missed. Should
+ * be called as configuration starts.
+ *
+ * format:	The upload's format (a BITSTREAM_ constant).
+ */
+void cache_capture_start(uint8_t format)
+{
+	sd_file file;
+
+	cache_capture_abort();
+
+	if(!cache_upload.armed)
+		return;
+
+	cache_upload.armed = false;
+	cache_upload.format = format;
+	cache_upload.received_crc = CRC32_INITIAL;
+	cache_upload.received_length = 0;
+
+	if(!cache_slot_file(cache_upload.slot, &file))
+		return;
+
+	cache_upload.capturing = sd_write_start(&file);
+
+	if(!cache_upload.capturing)
+		sd_write_stop();
+}
+
+/**
+ * cache_capture
+ *
+ * Copies part of the upload into the cache.
+ */
+void cache_capture(const uint8_t* data, uint16_t length)
+{
+	if(!cache_upload.capturing)
+		return;
+
+	//an upload longer than expected doesn't match, and may not fit
+	if(length > cache_upload.length - cache_upload.received_length)
+	{
+		cache_capture_abort();
+		return;
+	}
+
+	cache_upload.received_crc = crc32_block(cache_upload.received_crc, data, length);
+	cache_upload.received_length += length;
+
+	sd_write_block(data, length);
+}
+
+/**
+ * cache_capture_end
+ *
+ * Finishes copying the upload; if it matches the lookup, and the FPGA was
+ * configured successfully, it's added to the cache.
+ *
+ * configured:	True iff the FPGA started.
+ */
+void cache_capture_end(bool configured)
+{
+	cache_index index;
+	sd_file index_file;
+
+	if(!cache_upload.capturing)
+		return;
+
+	cache_upload.capturing = false;
+
+	if(!sd_write_stop() || !configured || cache_upload.received_length != cache_upload.length ||
+	   ~cache_upload.received_crc != cache_upload.crc)
+		return;
+
+	if(!cache_read_index(&index, &index_file))
+		return;
+
+	index.entries[cache_upload.slot].crc = cache_upload.crc;
+	index.entries[cache_upload.slot].length = cache_upload.length;
+	index.entries[cache_upload.slot].used = cache_newest(&index) + 1;
+	index.entries[cache_upload.slot].format = cache_upload.format;
+
+	cache_write_index(&index, &index_file);
+}
+
+/**
+ * cache_capture_abort
+ *
+ * Stops copying the upload, which won't be added to the cache; needed before
+ * anything else uses the card.
+ */
+void cache_capture_abort(void)
+{
+	if(cache_upload.capturing)
+		sd_write_stop();
+
+	cache_upload.capturing = false;
+}
+
+#else
+
+void cache_capture_start(uint8_t format)
+{
+}
+
+void cache_capture(const uint8_t* data, uint16_t length)
+{
+}
+
+void cache_capture_end(bool configured)
+{
+}
+
+void cache_capture_abort(void)
+{
+}
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+/**
+ * Bitstream Cache
+ *
+ * Keeps recently uploaded bitstreams on the SD card, keyed by their CRC-32 and
+ * length, so a design which has been loaded before can be reconfigured without
+ * uploading it again. The host looks the bitstream up first; on a hit, the FPGA
+ * is configured straight from the card. On a miss, the host uploads it as usual
+ * (CMD_FPGA_CONFIG_START or CMD_FPGA_CONFIG_FILE through CMD_FPGA_CONFIG_END), and
+ * the upload is copied to the card as it passes through, replacing the least
+ * recently used entry. Each entry records the upload's format, so it can be
+ * configured the same way.
+ *
+ * The cache's files must be created (at their full size) when the card is
+ * prepared, as files are never created or resized (see sd.h): the index,
+ * CACHE.IDX (at least one sector), and one file per entry, CACHE0.BIN through
+ * CACHE7.BIN (each at least as large as the bitstreams it should hold). Any
+ * of the entry files may be left out, for a smaller cache.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sd.h"
+
+//Most entries in the cache.
+#define CACHE_SLOTS		8
+
+//No entry; as given by cache_lookup when a bitstream can't be cached.
+#define CACHE_NONE		0xFF
+
+//Identifies a valid index. Changed with the layout of cache_entry, so an index
+//written in an older layout reads as empty ("UCIX" had no format field).
+#define CACHE_MAGIC		0x32494355	/* "UCI2" */
+
+//An entry of the index. Entries with a length of zero are empty.
+typedef struct
+{
+	uint32_t crc;
+	uint32_t length;
+	uint32_t used;		/* when last used; larger is more recent */
+	uint8_t format;		/* the upload's format (a BITSTREAM_ constant) */
+	uint8_t reserved[3];
+} cache_entry;
+
+//The index, in the first sector of CACHE.IDX.
+typedef struct
+{
+	uint32_t magic;		/* CACHE_MAGIC */
+	cache_entry entries[CACHE_SLOTS];
+} cache_index;
+
+#ifdef SD_CARD
+bool cache_lookup(uint32_t crc, uint32_t length, sd_file* file, uint8_t* slot, uint8_t* format);
+#endif
+
+void cache_capture_start(uint8_t format);
+void cache_capture(const uint8_t* data, uint16_t length);
+void cache_capture_end(bool configured);
+void cache_capture_abort(void);
@@ -0,0 +1,175 @@
+/**
+ * FPGA Clock Output
+ *
+ * Generates the FPGA's clock on OC4D (PD7) using Timer4.
+ *
+ * With no duty cycle specified, OC4D toggles each time the timer is cleared,
+ * which gives a 50% duty cycle at half of the timer rate:
+ *
+ *     f = f_source / prescale / (top + 1) / 2
+ *
+ * With a duty cycle specified, Timer4 runs in fast PWM mode; OC4D is set at
+ * BOTTOM and cleared on a match with OCR4D:
+ *
+ *     f = f_source / prescale / (top + 1)
+ */
+
+#include "clock.h"
+
+#include <stdbool.h>
+
+#ifdef CLOCK_OUT
+
+/*
+ * clock_source_frequency
+ *
+ * Returns the frequency of the given Timer4 clock source, in Hz;
+ * or zero if the source isn't valid.
+ */
+static uint32_t clock_source_frequency(uint8_t source)
+{
+	switch(source)
+	{
+		case CLOCK_SOURCE_SYSTEM:
+			return F_CPU;
+
+		case CLOCK_SOURCE_PLL_64MHZ:
+			return 64000000UL;
+
+		case CLOCK_SOURCE_PLL_48MHZ:
+			return 48000000UL;
+
+		default:
+			return 0;
+	}
+}
+
+/**
+ * clock_out_set
+ *
+ * Reprograms the FPGA clock output.
+ *
+ * source:	The Timer4 clock source (a CLOCK_SOURCE constant).
+ * 			The PLL sources are only available while the PLL is locked
+ * 			(i.e. while the USB subsystem is running).
+ * prescaler:	The Timer4 prescaler select (CS43:0), from 1 to 15;
+ * 			the timer clock is divided by 2^(prescaler - 1).
+ * top:		The timer TOP value (OCR4C).
+ * duty:	If zero, the output toggles on each timer clear (50% duty).
+ * 			Otherwise, the output is high for _duty_ of every (top + 1)
+ * 			timer counts; duty should be no greater than top.
+ *
+ * Returns: The exact output frequency achieved, in Hz; or zero if the
+ * 			request couldn't be met (in which case the clock is unchanged).
+ */
+uint32_t clock_out_set(uint8_t source, uint8_t prescaler, uint8_t top, uint8_t duty)
+{
+	uint32_t frequency = clock_source_frequency(source);
+	bool use_pll = (source != CLOCK_SOURCE_SYSTEM);
+
+	//validate the request
+	if(!frequency || !prescaler || prescaler > CLOCK_PRESCALER_MAX || duty > top)
+		return 0;
+
+	//the PLL can only be used once it has locked
+	if(use_pll && !(PLLCSR & (1 << PLOCK)))
+		return 0;
+
+	//stop the timer while its clock source changes
+	TCCR4B = 0;
+	TCNT4 = 0;
+
+	//select the timer's clock source
+	PLLFRQ &= ~(1 << PLLTM1 | 1 << PLLTM0);
+
+	if(source == CLOCK_SOURCE_PLL_64MHZ)
+		PLLFRQ |= (1 << PLLTM1);
+	else if(source == CLOCK_SOURCE_PLL_48MHZ)
+		PLLFRQ |= (1 << PLLTM1 | 1 << PLLTM0);
+
+	//set the timer's TOP and compare values (the high bits are always zero)
+	TC4H = 0;
+	OCR4C = top;
+	TC4H = 0;
+	OCR4D = duty;
+
+	//normal waveform generation (fast PWM, if enabled)
+	TCCR4D &= ~(1 << WGM41 | 1 << WGM40);
+
+	if(duty)
+	{
+		//set OC4D at BOTTOM, clear on compare match
+		TCCR4C = (TCCR4C & ~(1 << COM4D0)) | (1 << COM4D1) | (1 << PWM4D);
+	}
+	else
+	{
+		//toggle OC4D each time the counter is cleared
+		TCCR4C = (TCCR4C & ~(1 << COM4D1 | 1 << PWM4D)) | (1 << COM4D0);
+
+		//toggling halves the output frequency
+		frequency /= 2;
+	}
+
+	//restart the timer, with the dead-time prescaler disabled
+	TCCR4B = prescaler;
+
+	//and compute the frequency achieved
+	return frequency / ((uint32_t)(top + 1) << (prescaler - 1));
+}
+
+#endif
+
+/**
+ * clock_out_initialize
+ *
+ * Sets up OC4D as an output, and starts the default FPGA clock:
+ * the system clock toggled on every cycle (8MHz at F_CPU = 16MHz).
+ *
+ * Must be called before the USB subsystem starts the PLL.
+ */
+void clock_out_initialize(void)
+{
+#ifdef CLOCK_OUT
+	//Run the PLL at 96MHz, and divide it by two to get the USB clock.
+	//This leaves the full PLL output available to the high-speed timer.
+	//(The timer remains disconnected from the PLL until requested.)
+	PLLFRQ = (1 << PDIV3) | (1 << PDIV1) | (1 << PLLUSB);
+#endif
+
+	//set pin D7 to output
+	DDRD |= 1 << PD7;
+	PORTD |= 1 << PD7;
+
+	//and start the default clock
+#ifdef CLOCK_OUT
+	clock_out_set(CLOCK_SOURCE_SYSTEM, 1, 0, 0);
+#else
+	//toggle OC4D each time the counter is cleared, which is on every clock
+	TC4H = 0;
+	OCR4C = 0;
+	TCCR4C = (1 << COM4D0);
+	TCCR4B = (1 << CS40);
+#endif
+}
+
+/**
+ * clock_out_stop
+ *
+ * Stops the FPGA clock and releases Timer4 and OC4D; as before leaving for the
+ * application.
+ */
+void clock_out_stop(void)
+{
+	TCCR4B = 0;
+	TCCR4C = 0;
+	TCCR4D = 0;
+
+#ifdef CLOCK_OUT
+	//disconnect the timer from the PLL
+	PLLFRQ &= ~(1 << PLLTM1 | 1 << PLLTM0);
+#endif
+
+	//and return OC4D to its reset state
+	DDRD &= ~(1 << PD7);
+	PORTD &= ~(1 << PD7);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/**
+ * FPGA Clock Output
+ *
+ * The FPGA's clock is driven from Timer4 on OC4D (PD7). Timer4 can be clocked
+ * either from the system clock, or from the 32U4's high-speed PLL; the clock
+ * can only be reprogrammed in CLOCK_OUT builds (see unilab.h).
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "unilab.h"
+
+//Timer4 clock sources.
+#define CLOCK_SOURCE_SYSTEM	0x00	/* system clock (F_CPU) */
+#define CLOCK_SOURCE_PLL_64MHZ	0x01	/* 96MHz PLL output, postscaled by 1.5 */
+#define CLOCK_SOURCE_PLL_48MHZ	0x02	/* 96MHz PLL output, postscaled by 2 */
+
+//Maximum Timer4 prescaler select (CS43:0); each step doubles the divider.
+#define CLOCK_PRESCALER_MAX	0x0F
+
+void clock_out_initialize(void);
+void clock_out_stop(void);
+
+#ifdef CLOCK_OUT
+uint32_t clock_out_set(uint8_t source, uint8_t prescaler, uint8_t top, uint8_t duty);
+#endif
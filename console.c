@@ -0,0 +1,117 @@
+/**
+ * JTAG Virtual Console
+ *
+ * The mailbox is polled from the main loop; see console_task. The polling
+ * rate adapts to activity, so an idle console costs little time, while a
+ * busy one is polled every status timer tick. Characters reach the host no
+ * sooner than its next poll of the interrupt IN endpoint, though, which is
+ * every millisecond (see Descriptors.c); so their latency is at least 1ms.
+ */
+
+#include "console.h"
+#include "jtag/fpga.h"
+
+#ifdef JTAG_CONSOLE
+
+//True iff the console is being polled.
+static bool console_enabled = false;
+
+//Characters received from the mailbox, waiting to be sent to the host.
+static uint8_t console_buffer[CONSOLE_BUFFER_SIZE];
+static uint8_t console_head = 0;
+static uint8_t console_count = 0;
+
+//Status timer value at the last poll, and the current polling interval.
+static uint16_t console_last_poll = 0;
+static uint8_t console_interval = CONSOLE_POLL_MIN;
+
+/**
+ * console_set_enabled
+ *
+ * Starts or stops polling the console mailbox. Polling must be stopped
+ * before the FPGA is reconfigured.
+ */
+void console_set_enabled(bool enabled)
+{
+	console_enabled = enabled;
+
+	//start each session with an empty buffer, polling quickly
+	console_head = 0;
+	console_count = 0;
+	console_interval = CONSOLE_POLL_MIN;
+	console_last_poll = TCNT1;
+}
+
+/**
+ * console_is_enabled
+ *
+ * Returns: True iff the console mailbox is being polled.
+ */
+bool console_is_enabled(void)
+{
+	return console_enabled;
+}
+
+/**
+ * console_task
+ *
+ * Small daemon 'thread' which polls the console mailbox when due.
+ * Should be called from the main loop.
+ */
+void console_task(void)
+{
+	int c;
+
+	if(!console_enabled)
+		return;
+
+	//wait until the next poll is due
+	if((uint16_t)(TCNT1 - console_last_poll) < console_interval)
+		return;
+
+	//if the host isn't keeping up, leave the characters in the mailbox
+	if(console_count == CONSOLE_BUFFER_SIZE)
+		return;
+
+	console_last_poll = TCNT1;
+	c = fpga_mailbox_poll();
+
+	if(c < 0)
+	{
+		//back off while the console is idle
+		if(console_interval < CONSOLE_POLL_MAX)
+			console_interval <<= 1;
+
+		return;
+	}
+
+	//store the character, and poll quickly while the console is busy
+	console_buffer[(console_head + console_count) % CONSOLE_BUFFER_SIZE] = c;
+	++console_count;
+
+	console_interval = CONSOLE_POLL_MIN;
+}
+
+/**
+ * console_read
+ *
+ * Removes up to size characters from the console buffer.
+ *
+ * Returns: The number of characters read.
+ */
+uint8_t console_read(uint8_t* buffer, uint8_t size)
+{
+	uint8_t count = 0;
+
+	while(count < size && console_count)
+	{
+		buffer[count++] = console_buffer[console_head];
+
+		console_head = (console_head + 1) % CONSOLE_BUFFER_SIZE;
+		--console_count;
+	}
+
+	return count;
+}
+
+#endif
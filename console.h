@@ -0,0 +1,46 @@
+#pragma once
+
+/**
+ * JTAG Virtual Console
+ *
+ * Forwards characters from a soft-core design's console mailbox (in the
+ * FPGA's USER2 register) to the host, over the HID interrupt IN endpoint;
+ * up to GENERIC_REPORT_SIZE - 2 characters per report, one report per 1ms
+ * endpoint polling interval.
+ * Only built into JTAG_CONSOLE builds (see unilab.h).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+#include "unilab.h"
+
+//Size of the buffer between the mailbox and the host, in characters.
+#define CONSOLE_BUFFER_SIZE 32
+
+//Mailbox polling intervals, in status timer (Timer1) ticks of 64us.
+//The interval shrinks to the minimum while characters are arriving,
+//and doubles with each empty poll up to the maximum.
+#define CONSOLE_POLL_MIN 1
+#define CONSOLE_POLL_MAX 8
+
+#ifdef JTAG_CONSOLE
+
+void console_set_enabled(bool enabled);
+bool console_is_enabled(void);
+void console_task(void);
+uint8_t console_read(uint8_t* buffer, uint8_t size);
+
+#else
+
+//Without the console, there's nothing to stop or poll.
+static inline void console_set_enabled(bool enabled)
+{
+}
+
+static inline void console_task(void)
+{
+}
+
+#endif
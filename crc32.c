@@ -0,0 +1,44 @@
+/**
+ * CRC-32
+ */
+
+#include "crc32.h"
+
+#include <avr/pgmspace.h>
+
+//The CRC of each nibble.
+static const uint32_t PROGMEM crc32_table[16] =
+{
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+/**
+ * crc32_update
+ *
+ * Adds a byte to a running CRC, which starts at CRC32_INITIAL.
+ *
+ * Returns: The new running CRC.
+ */
+uint32_t crc32_update(uint32_t crc, uint8_t c)
+{
+	crc = pgm_read_dword(&crc32_table[(crc ^ c) & 0x0F]) ^ (crc >> 4);
+	crc = pgm_read_dword(&crc32_table[(crc ^ (c >> 4)) & 0x0F]) ^ (crc >> 4);
+
+	return crc;
+}
+
+/**
+ * crc32_block
+ *
+ * Adds a block of data to a running CRC.
+ *
+ * Returns: The new running CRC.
+ */
+uint32_t crc32_block(uint32_t crc, const uint8_t* data, uint16_t length)
+{
+	while(length--)
+		crc = crc32_update(crc, *data++);
+
+	return crc;
+}
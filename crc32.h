@@ -0,0 +1,17 @@
+#pragma once
+
+/**
+ * CRC-32
+ *
+ * The CRC-32 of zlib and Ethernet (reflected, polynomial 0xEDB88320), so hosts
+ * can compute it with their standard libraries. It's computed a nibble at a
+ * time, with a 64-byte table in program memory.
+ */
+
+#include <stdint.h>
+
+//Initial value of a CRC; the final CRC is the running value, inverted.
+#define CRC32_INITIAL	0xFFFFFFFF
+
+uint32_t crc32_update(uint32_t crc, uint8_t c);
+uint32_t crc32_block(uint32_t crc, const uint8_t* data, uint16_t length);
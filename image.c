@@ -0,0 +1,151 @@
+/**
+ * Flash Bitstream Image
+ *
+ * The image is decompressed a byte at a time, as the JTAG chain takes it (see
+ * jtag_shift_stream), so nothing but the decoder's state is kept in RAM.
+ */
+
+#include "image.h"
+#include "crc32.h"
+
+#include <avr/pgmspace.h>
+
+#ifdef FLASH_IMAGE
+
+//PackBits control bytes.
+#define IMAGE_LITERAL_MAX	127	/* up to this, n + 1 literal bytes follow */
+#define IMAGE_NOP		128	/* skipped */
+
+//The image being decompressed.
+static struct
+{
+	bool error;
+	bool repeat;		/* the current run repeats a single byte, rather than copying bytes */
+	uint8_t value;		/* the byte repeated */
+	uint8_t count;		/* bytes left in the current run */
+	uint16_t address;	/* of the next compressed byte */
+	uint16_t end;		/* of the compressed bitstream */
+} image_stream;
+
+/*
+ * image_read_header
+ *
+ * Reads the image's header, and checks that it's an image.
+ */
+static bool image_read_header(image_header* header)
+{
+	uint8_t* data = (uint8_t*)header;
+
+	for(uint8_t i = 0; i < sizeof(image_header); ++i)
+		data[i] = pgm_read_byte(IMAGE_ADDRESS + i);
+
+	return header->magic == IMAGE_MAGIC && header->packed_length <= IMAGE_MAX_PACKED;
+}
+
+/**
+ * image_present
+ *
+ * Returns: True iff an image is stored (though it may be incomplete).
+ */
+bool image_present(void)
+{
+	image_header header;
+
+	return image_read_header(&header);
+}
+
+/**
+ * image_start
+ *
+ * Checks the stored image, and starts decompressing it; its bytes are then read
+ * with image_next, and decompression checked by image_finish.
+ *
+ * length:	Receives the length of the bitstream.
+ *
+ * Returns: True iff a complete image is stored.
+ */
+bool image_start(uint32_t* length)
+{
+	image_header header;
+	uint32_t crc = CRC32_INITIAL;
+	uint16_t address = IMAGE_ADDRESS + sizeof(image_header);
+
+	if(!image_read_header(&header))
+		return false;
+
+	image_stream.end = address + header.packed_length;
+
+	//check the compressed bitstream, which may have been only partly written
+	while(address < image_stream.end)
+		crc = crc32_update(crc, pgm_read_byte(address++));
+
+	if(~crc != header.crc)
+		return false;
+
+	image_stream.error = false;
+	image_stream.count = 0;
+	image_stream.address = IMAGE_ADDRESS + sizeof(image_header);
+
+	*length = header.length;
+	return true;
+}
+
+/**
+ * image_next
+ *
+ * Returns: The next byte of the bitstream; or 0xFF if the compressed bitstream
+ * 			has ended early, in which case image_finish will fail. A
+ * 			jtag_byte_source.
+ */
+uint8_t image_next(void)
+{
+	while(!image_stream.count)
+	{
+		uint8_t control;
+
+		if(image_stream.address >= image_stream.end)
+		{
+			image_stream.error = true;
+			return 0xFF;
+		}
+
+		control = pgm_read_byte(image_stream.address++);
+
+		if(control <= IMAGE_LITERAL_MAX)
+		{
+			image_stream.repeat = false;
+			image_stream.count = control + 1;
+		}
+		else if(control != IMAGE_NOP && image_stream.address < image_stream.end)
+		{
+			image_stream.repeat = true;
+			image_stream.count = 257 - control;
+			image_stream.value = pgm_read_byte(image_stream.address++);
+		}
+	}
+
+	--image_stream.count;
+
+	if(image_stream.repeat)
+		return image_stream.value;
+
+	if(image_stream.address >= image_stream.end)
+	{
+		image_stream.error = true;
+		return 0xFF;
+	}
+
+	return pgm_read_byte(image_stream.address++);
+}
+
+/**
+ * image_finish
+ *
+ * Returns: True iff the compressed bitstream held exactly the bitstream's length.
+ */
+bool image_finish(void)
+{
+	return !image_stream.error && !image_stream.count && image_stream.address == image_stream.end;
+}
+
+#endif
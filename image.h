@@ -0,0 +1,58 @@
+#pragma once
+
+/**
+ * Flash Bitstream Image
+ *
+ * On boards used only as FPGA programmers, the application region of flash
+ * (below BOOTLOADER_START) is unused; it can instead hold a compressed default
+ * bitstream, which configures the FPGA at power-up. The host writes the image
+ * with the usual flash page writes, starting at IMAGE_ADDRESS: an image_header,
+ * followed by the compressed bitstream. The bitstream is a configuration file,
+ * .bit or .bin, as written by bitgen (see jtag/bitstream.h).
+ *
+ * The bitstream is compressed with PackBits run-length encoding: each control
+ * byte n is followed either by n + 1 literal bytes (n of 0 to 127), or by a
+ * single byte to be repeated 257 - n times (n of 129 to 255); a control byte of
+ * 128 is skipped. Bitstreams are mostly long runs of zeroes (unused frames) and
+ * ones (padding), so typical designs compress several times over.
+ *
+ * While an image is stored, there's no application to run (see CMD_SOFT_RESET).
+ *
+ * Only built into FLASH_IMAGE builds (see unilab.h).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+#include "unilab.h"
+#include "bench.h"
+
+//Identifies an image.
+#define IMAGE_MAGIC		0x54494255	/* "UBIT" */
+
+//Location of the image: the start of the application region.
+#define IMAGE_ADDRESS		0x0000
+
+//Largest compressed bitstream; the image ends short of the flash benchmark's
+//scratch page, which the benchmark erases.
+#define IMAGE_MAX_PACKED	(BENCH_FLASH_PAGE - IMAGE_ADDRESS - sizeof(image_header))
+
+//Header of an image.
+typedef struct
+{
+	uint32_t magic;		/* IMAGE_MAGIC */
+	uint32_t length;	/* length of the bitstream, in bytes */
+	uint16_t packed_length;	/* length of the compressed bitstream which follows, in bytes */
+	uint16_t reserved;
+	uint32_t crc;		/* CRC-32 (see crc32.h) of the compressed bitstream */
+} image_header;
+
+#ifdef FLASH_IMAGE
+
+bool image_present(void);
+bool image_start(uint32_t* length);
+uint8_t image_next(void);
+bool image_finish(void);
+
+#endif
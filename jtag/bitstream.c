@@ -0,0 +1,560 @@
+/**
+ * Xilinx Configuration Files
+ *
+ * The header is parsed a byte at a time, so a file can be split anywhere
+ * between the blocks it arrives in. The bitstream itself is shifted a block
+ * at a time; the last byte of each block is held back until the next arrives,
+ * as only once the file ends is it known which byte ends the scan.
+ *
+ * Packets are built from 32-bit words on the Spartan-3E, and 16-bit words on
+ * the Spartan-6, which also moves the fields of the packet header, and gives
+ * type 2 packets their word count in the two words following the header.
+ */
+
+#include "bitstream.h"
+#include "fpga.h"
+
+#include <string.h>
+
+#ifdef BITSTREAM_FILES
+
+//File parser states.
+#define BITSTREAM_STATE_START	0	/* expecting the first byte of the file */
+#define BITSTREAM_STATE_KEY	1	/* expecting a field's key */
+#define BITSTREAM_STATE_LENGTH	2	/* reading a field's length */
+#define BITSTREAM_STATE_SKIP	3	/* skipping a field */
+#define BITSTREAM_STATE_DATA	4	/* in the bitstream */
+
+//Packet checker states.
+#define PACKETS_SYNC		0	/* looking for the sync word */
+#define PACKETS_HEADER		1	/* expecting a packet header */
+#define PACKETS_VALUE		2	/* reading the value written to a register */
+#define PACKETS_COUNT		3	/* reading a Spartan-6 type 2 packet's word count */
+
+static struct
+{
+	uint8_t format;		/* a BITSTREAM_ format */
+	uint8_t state;
+	uint8_t key;		/* of the current field; zero for the first */
+	uint8_t count;		/* bytes of the length still to come */
+	uint32_t value;		/* the length so far; or bytes left to skip */
+	bool sized;		/* the bitstream's length is known */
+	uint32_t remaining;	/* bytes of the bitstream still to come, if sized */
+	bool started;		/* some of the bitstream has been shifted */
+	bool pending;		/* a byte is held back */
+	uint8_t held;
+} bitstream;
+
+static struct
+{
+	uint8_t state;
+	uint8_t error;		/* a BITSTREAM_ result; sticky */
+	uint8_t word_size;	/* bytes in a configuration word */
+	uint8_t word_bytes;	/* bytes of the current word received */
+	uint32_t word;
+	uint16_t reg;		/* the register being written */
+	uint16_t words;		/* words of the value still to come */
+	uint32_t value;
+	uint32_t skip;		/* bytes of packet data which needn't be checked */
+	uint32_t left;		/* bytes of the bitstream not yet checked, if sized */
+	uint32_t room;		/* bytes more the FPGA's full bitstream could span */
+} packets;
+
+/*
+ * bitstream_set_length
+ *
+ * Records the length of the bitstream, once it's known.
+ */
+static void bitstream_set_length(uint32_t length)
+{
+	bitstream.sized = true;
+	bitstream.remaining = length;
+	packets.left = length;
+
+	//a bitstream longer than the FPGA's own was built for a larger device
+	if(length > packets.room)
+	{
+		packets.error = BITSTREAM_WRONG_DEVICE;
+		fpga_reset();
+	}
+}
+
+/*
+ * bitstream_parse
+ *
+ * Parses a byte of the file's header.
+ *
+ * Returns: True iff the byte was part of the header; false iff it was the first
+ * byte of a .bin file, and so of the bitstream.
+ */
+static bool bitstream_parse(uint8_t c)
+{
+	switch(bitstream.state)
+	{
+		case BITSTREAM_STATE_START:
+
+			if(c)
+			{
+				bitstream.state = BITSTREAM_STATE_DATA;
+				return false;
+			}
+
+			//the first field has no key; this was the high byte of its length
+			bitstream.key = 0;
+			bitstream.count = 1;
+			bitstream.value = 0;
+			bitstream.state = BITSTREAM_STATE_LENGTH;
+			break;
+
+		case BITSTREAM_STATE_KEY:
+
+			bitstream.key = c;
+			bitstream.count = (c == BITSTREAM_DATA_KEY) ? 4 : 2;
+			bitstream.value = 0;
+			bitstream.state = BITSTREAM_STATE_LENGTH;
+			break;
+
+		case BITSTREAM_STATE_LENGTH:
+
+			bitstream.value = (bitstream.value << 8) | c;
+
+			if(--bitstream.count)
+				break;
+
+			if(bitstream.key == BITSTREAM_DATA_KEY)
+			{
+				bitstream_set_length(bitstream.value);
+				bitstream.state = BITSTREAM_STATE_DATA;
+				break;
+			}
+
+			//the first field is followed by the length of the first key (0x0001),
+			//which is skipped along with it
+			if(!bitstream.key)
+				bitstream.value += 2;
+
+			bitstream.state = bitstream.value ? BITSTREAM_STATE_SKIP : BITSTREAM_STATE_KEY;
+			break;
+
+		case BITSTREAM_STATE_SKIP:
+
+			if(!--bitstream.value)
+				bitstream.state = BITSTREAM_STATE_KEY;
+			break;
+	}
+
+	return true;
+}
+
+/*
+ * bitstream_skip_words
+ *
+ * Skips a packet's data.
+ *
+ * Returns: A BITSTREAM_ result.
+ */
+static uint8_t bitstream_skip_words(uint32_t count)
+{
+	//a packet which runs past the end of the bitstream can never be completed
+	if(bitstream.sized && count > packets.left / packets.word_size)
+		return BITSTREAM_INCOMPLETE;
+
+	packets.skip = count * packets.word_size;
+	return BITSTREAM_OK;
+}
+
+/*
+ * bitstream_check_word
+ *
+ * Checks a word of the bitstream, following the sync word.
+ *
+ * Returns: A BITSTREAM_ result.
+ */
+static uint8_t bitstream_check_word(uint32_t word)
+{
+	bool spartan6 = (packets.word_size == 2);
+	uint16_t cmd = spartan6 ? BITSTREAM_REG_CMD_SPARTAN6 : BITSTREAM_REG_CMD;
+	uint8_t type;
+
+	switch(packets.state)
+	{
+		case PACKETS_HEADER:
+
+			type = word >> (spartan6 ? 13 : 29);
+
+			if(type == BITSTREAM_TYPE_1)
+			{
+				uint8_t op = (word >> (spartan6 ? 11 : 27)) & 0x03;
+				uint16_t count = word & (spartan6 ? 0x1F : BITSTREAM_TYPE_1_MAX);
+
+				packets.reg = spartan6 ? (word >> 5) & 0x3F : (word >> 13) & 0x3FFF;
+
+				//the values of IDCODE and command writes are checked, rather than skipped
+				if(op == BITSTREAM_OP_WRITE && count &&
+				   (packets.reg == BITSTREAM_REG_IDCODE || packets.reg == cmd))
+				{
+					packets.state = PACKETS_VALUE;
+					packets.words = count;
+					packets.value = 0;
+					return BITSTREAM_OK;
+				}
+
+				return bitstream_skip_words(count);
+			}
+
+			if(type == BITSTREAM_TYPE_2)
+			{
+				if(!spartan6)
+					return bitstream_skip_words(word & BITSTREAM_TYPE_2_MAX);
+
+				packets.state = PACKETS_COUNT;
+				packets.words = 2;
+				packets.value = 0;
+				return BITSTREAM_OK;
+			}
+
+			return BITSTREAM_MALFORMED;
+
+		case PACKETS_VALUE:
+
+			packets.value = spartan6 ? (packets.value << 16) | word : word;
+
+			if(--packets.words)
+				return BITSTREAM_OK;
+
+			packets.state = PACKETS_HEADER;
+
+			//the FPGA would refuse the bitstream once it reached this write
+			if(packets.reg == BITSTREAM_REG_IDCODE)
+				if(fpga_idcode && ((packets.value ^ fpga_idcode) & FPGA_IDCODE_MASK))
+					return BITSTREAM_WRONG_DEVICE;
+
+			//after DESYNC, the FPGA ignores everything until the next sync word
+			if(packets.reg == cmd && packets.value == BITSTREAM_CMD_DESYNC)
+				packets.state = PACKETS_SYNC;
+
+			return BITSTREAM_OK;
+
+		case PACKETS_COUNT:
+
+			packets.value = (packets.value << 16) | word;
+
+			if(--packets.words)
+				return BITSTREAM_OK;
+
+			packets.state = PACKETS_HEADER;
+			return bitstream_skip_words(packets.value);
+	}
+
+	return BITSTREAM_OK;
+}
+
+/*
+ * bitstream_check_byte
+ *
+ * Checks a byte of the bitstream, MSB first.
+ *
+ * Returns: A BITSTREAM_ result.
+ */
+static uint8_t bitstream_check_byte(uint8_t c)
+{
+	packets.word = (packets.word << 8) | c;
+
+	if(packets.state == PACKETS_SYNC)
+	{
+		if(packets.word == BITSTREAM_SYNC_WORD)
+		{
+			packets.state = PACKETS_HEADER;
+			packets.word_bytes = 0;
+		}
+
+		return BITSTREAM_OK;
+	}
+
+	if(++packets.word_bytes < packets.word_size)
+		return BITSTREAM_OK;
+
+	packets.word_bytes = 0;
+
+	return bitstream_check_word((packets.word_size == 2) ? (uint16_t)packets.word : packets.word);
+}
+
+/*
+ * bitstream_shift
+ *
+ * Shifts part of the bitstream, in the order of its format.
+ */
+static void bitstream_shift(const uint8_t* data, uint16_t length, bool last)
+{
+	if(!length)
+		return;
+
+	if(bitstream.format == BITSTREAM_FILE)
+		jtag_shift_block_msb(data, length, !bitstream.started, last);
+	else
+		jtag_shift_block(data, length, !bitstream.started, last);
+
+	bitstream.started = true;
+}
+
+/*
+ * bitstream_release
+ *
+ * Shifts the byte held back, if any.
+ *
+ * last:	True iff the byte ends the bitstream.
+ */
+static void bitstream_release(bool last)
+{
+	if(!bitstream.pending)
+		return;
+
+	bitstream.pending = false;
+	bitstream_shift(&bitstream.held, 1, last);
+}
+
+/**
+ * bitstream_start
+ *
+ * Starts receiving a bitstream. Should follow fpga_init_config, which
+ * identifies the FPGA whose IDCODE the bitstream must match.
+ *
+ * format:	The format of the data to come (a BITSTREAM_ constant).
+ */
+void bitstream_start(uint8_t format)
+{
+	memset(&bitstream, 0, sizeof(bitstream));
+	memset(&packets, 0, sizeof(packets));
+
+	bitstream.format = format;
+	packets.word_size = (fpga_device.part.family == FPGA_FAMILY_SPARTAN6) ? 2 : 4;
+
+	//the FPGA's full bitstream bounds the upload, where the part is known
+	if(fpga_device.part.bitstream_bits)
+		packets.room = fpga_device.part.bitstream_bits / 8 + BITSTREAM_LENGTH_SLACK;
+	else
+		packets.room = UINT32_MAX;
+
+	//a reversed bitstream has no header
+	if(format == BITSTREAM_REVERSED)
+		bitstream.state = BITSTREAM_STATE_DATA;
+}
+
+/**
+ * bitstream_check_block
+ *
+ * Checks the next block of the bitstream, before it's sent; see bitstream_send_block,
+ * which checks the blocks of files itself. Once a problem is found, the FPGA's
+ * TAP is reset, abandoning the scan, and nothing more should be sent.
+ *
+ * Returns: True iff no problem has been found.
+ */
+bool bitstream_check_block(const uint8_t* data, uint16_t length)
+{
+	//the length of an upload without a header is only known as it arrives
+	if(length > packets.room)
+	{
+		if(!packets.error)
+		{
+			packets.error = BITSTREAM_WRONG_DEVICE;
+			bitstream.pending = false;
+			fpga_reset();
+		}
+
+		return false;
+	}
+
+	packets.room -= length;
+
+	while(length && !packets.error)
+	{
+		uint8_t c;
+
+		//packet data is skipped in bulk
+		if(packets.skip)
+		{
+			uint16_t run = (packets.skip < length) ? packets.skip : length;
+
+			packets.skip -= run;
+			data += run;
+			length -= run;
+
+			if(bitstream.sized)
+				packets.left -= run;
+			continue;
+		}
+
+		c = *data++;
+		--length;
+
+		if(bitstream.sized)
+			--packets.left;
+
+		packets.error = bitstream_check_byte((bitstream.format == BITSTREAM_REVERSED) ? jtag_reverse(c) : c);
+
+		if(packets.error)
+		{
+			bitstream.pending = false;
+			fpga_reset();
+		}
+	}
+
+	return !packets.error;
+}
+
+/**
+ * bitstream_error
+ *
+ * Returns: The problem found with the bitstream so far, as a BITSTREAM_ result.
+ */
+uint8_t bitstream_error(void)
+{
+	return packets.error;
+}
+
+/**
+ * bitstream_send_block
+ *
+ * Checks and sends the next block of a file to the FPGA; blocks may be of any
+ * length, and needn't line up with the header's fields. Data following the
+ * bitstream of a .bit file is ignored, as is everything after a problem.
+ */
+void bitstream_send_block(const uint8_t* data, uint16_t length)
+{
+	while(length && bitstream.state != BITSTREAM_STATE_DATA && bitstream_parse(*data))
+	{
+		++data;
+		--length;
+	}
+
+	if(bitstream.sized)
+	{
+		if(length > bitstream.remaining)
+			length = bitstream.remaining;
+
+		bitstream.remaining -= length;
+	}
+
+	if(!length || !bitstream_check_block(data, length))
+		return;
+
+	bitstream_release(false);
+	bitstream_shift(data, length - 1, false);
+
+	bitstream.held = data[length - 1];
+	bitstream.pending = true;
+
+	//a .bit file says where its bitstream ends, so the scan can end right away
+	if(bitstream.sized && !bitstream.remaining)
+		bitstream_release(true);
+}
+
+/**
+ * bitstream_finish
+ *
+ * Ends the bitstream, finishing the scan.
+ *
+ * Returns: A BITSTREAM_ result; a file is incomplete if it was empty, or its
+ * header or bitstream was cut short.
+ */
+uint8_t bitstream_finish(void)
+{
+	if(packets.error)
+		return packets.error;
+
+	bitstream_release(true);
+
+	//only files are known to be complete; other uploads end where the host says
+	if(bitstream.format == BITSTREAM_FILE && (!bitstream.started || (bitstream.sized && bitstream.remaining)))
+		return BITSTREAM_INCOMPLETE;
+
+	return BITSTREAM_OK;
+}
+
+/**
+ * bitstream_send_stream
+ *
+ * Checks and sends a whole bitstream, fetching each byte from a source as it's
+ * needed, as bitstream_start through bitstream_finish. Only the header and the
+ * packet headers are handled a byte at a time; packet data goes straight to
+ * jtag_shift_stream. Unless a problem is found, every byte of the file is read
+ * from the source, even those following the bitstream.
+ *
+ * length:	The length of the data.
+ * format:	The format of the data (a BITSTREAM_ constant).
+ *
+ * Returns: A BITSTREAM_ result.
+ */
+uint8_t bitstream_send_stream(jtag_byte_source source, uint32_t length, uint8_t format)
+{
+	uint32_t rest = 0;
+	uint8_t c;
+
+	bitstream_start(format);
+
+	while(length && bitstream.state != BITSTREAM_STATE_DATA)
+	{
+		c = source();
+		--length;
+
+		//the first byte of a .bin file is already part of the bitstream
+		if(!bitstream_parse(c))
+		{
+			bitstream_set_length(length + 1);
+			bitstream_send_block(&c, 1);
+		}
+	}
+
+	//without a .bit header, the bitstream is the rest of the data
+	if(!bitstream.sized)
+		bitstream_set_length(length);
+
+	if(length > bitstream.remaining)
+	{
+		rest = length - bitstream.remaining;
+		length = bitstream.remaining;
+	}
+
+	bitstream.remaining -= length;
+
+	while(length && !packets.error)
+	{
+		uint32_t run = (packets.skip < length) ? packets.skip : length;
+
+		if(run)
+		{
+			bitstream_release(false);
+
+			if(format == BITSTREAM_FILE)
+				jtag_shift_stream_msb(source, run, !bitstream.started, run == length);
+			else
+				jtag_shift_stream(source, run, !bitstream.started, run == length);
+
+			bitstream.started = true;
+			packets.skip -= run;
+			packets.left -= run;
+			length -= run;
+		}
+		else
+		{
+			c = source();
+			--length;
+
+			if(!bitstream_check_block(&c, 1))
+				break;
+
+			bitstream_release(false);
+			bitstream.held = c;
+			bitstream.pending = true;
+		}
+	}
+
+	//read out anything following the bitstream, so the source ends with the file
+	if(!packets.error)
+		while(rest--)
+			source();
+
+	return bitstream_finish();
+}
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+/**
+ * Xilinx Configuration Files
+ *
+ * Sends configuration files, as written by bitgen, to the FPGA unchanged:
+ * either .bit files, whose header is parsed as they arrive and skipped, or
+ * headerless .bin files. Both store the bitstream MSB first, so it's shifted
+ * with the MSB-first kernels, rather than needing each byte reversed by the
+ * host.
+ *
+ * A .bit file starts with a nine-byte field (always 0x0009 followed by
+ * 0FF00FF00FF00FF000), and the field length 0x0001; then keyed fields, each a
+ * key character and a big-endian 16-bit length followed by that many bytes:
+ * 'a' (design name), 'b' (part), 'c' (date) and 'd' (time). The last field,
+ * 'e', has a 32-bit length instead, and holds the bitstream itself.
+ * A .bin file starts with the bitstream's padding or sync word, so never with
+ * zero; a file whose first byte isn't zero is taken to be a .bin file, and is
+ * sent whole.
+ *
+ * As the bitstream passes through, its configuration packets are followed, so
+ * a bitstream which can't work is abandoned as soon as the problem is seen,
+ * rather than only once the FPGA fails to start: a write of an IDCODE other
+ * than the FPGA's, an invalid packet header, or (where the bitstream's length
+ * is known) a packet longer than the rest of the bitstream, or a bitstream
+ * longer than the FPGA's full bitstream (one built for a larger device).
+ * Packets are found from the sync word, and skipped by their word counts, so
+ * the bulk of the bitstream (frame data) needn't be looked at. CRC packets are
+ * skipped too; their values are left for the FPGA to check, as the CRC differs
+ * between families.
+ *
+ * Only built into BITSTREAM_FILES builds (see unilab.h); otherwise, only
+ * reversed bitstreams can be sent, and they aren't checked.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "core.h"
+
+//Formats of the data sent to configure the FPGA.
+#define BITSTREAM_REVERSED	0	/* the bitstream alone, each byte reversed (LSB first) */
+#define BITSTREAM_FILE		1	/* a .bit or .bin file, as written by bitgen */
+
+//Results of sending a bitstream.
+#define BITSTREAM_OK		0
+#define BITSTREAM_INCOMPLETE	1	/* the file was empty, or cut short */
+#define BITSTREAM_WRONG_DEVICE	2	/* the bitstream's IDCODE isn't the FPGA's, or it's too long */
+#define BITSTREAM_MALFORMED	3	/* a packet header was invalid */
+
+//Bytes a bitstream may run past the FPGA's full bitstream length, for padding.
+#define BITSTREAM_LENGTH_SLACK	256
+
+//Key of the .bit field holding the bitstream.
+#define BITSTREAM_DATA_KEY	'e'
+
+//Configuration packets.
+#define BITSTREAM_DUMMY_WORD	0xFFFFFFFF
+#define BITSTREAM_SYNC_WORD	0xAA995566
+#define BITSTREAM_TYPE_1	1
+#define BITSTREAM_TYPE_2	2
+#define BITSTREAM_OP_READ	1
+#define BITSTREAM_OP_WRITE	2
+#define BITSTREAM_REG_FAR	0x01
+#define BITSTREAM_REG_FDRO	0x03
+#define BITSTREAM_REG_IDCODE	0x0E
+#define BITSTREAM_REG_CMD	0x04
+#define BITSTREAM_REG_CMD_SPARTAN6	0x05
+#define BITSTREAM_CMD_RCFG	0x04
+#define BITSTREAM_CMD_RCRC	0x07
+#define BITSTREAM_CMD_GCAPTURE	0x0C
+#define BITSTREAM_CMD_DESYNC	0x0D
+
+//Spartan-3E packet headers.
+#define BITSTREAM_TYPE_1_MAX	0x7FF		/* most words in a type 1 packet */
+#define BITSTREAM_TYPE_2_MAX	0x07FFFFFF	/* and in a type 2 packet */
+#define BITSTREAM_NOOP		BITSTREAM_TYPE_1_HEADER(0, 0, 0)
+#define BITSTREAM_TYPE_1_HEADER(op, reg, count) \
+	(((uint32_t)BITSTREAM_TYPE_1 << 29) | ((uint32_t)(op) << 27) | ((uint32_t)(reg) << 13) | (count))
+#define BITSTREAM_TYPE_2_HEADER(op, count) \
+	(((uint32_t)BITSTREAM_TYPE_2 << 29) | ((uint32_t)(op) << 27) | (count))
+
+#ifdef BITSTREAM_FILES
+
+void bitstream_start(uint8_t format);
+void bitstream_send_block(const uint8_t* data, uint16_t length);
+bool bitstream_check_block(const uint8_t* data, uint16_t length);
+uint8_t bitstream_error(void);
+uint8_t bitstream_finish(void);
+uint8_t bitstream_send_stream(jtag_byte_source source, uint32_t length, uint8_t format);
+
+#else
+
+//Without BITSTREAM_FILES, only reversed bitstreams are sent, and they're sent
+//unchecked.
+static inline void bitstream_start(uint8_t format)
+{
+}
+
+static inline bool bitstream_check_block(const uint8_t* data, uint16_t length)
+{
+	return true;
+}
+
+static inline uint8_t bitstream_error(void)
+{
+	return BITSTREAM_OK;
+}
+
+static inline uint8_t bitstream_finish(void)
+{
+	return BITSTREAM_OK;
+}
+
+#endif
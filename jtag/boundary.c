@@ -0,0 +1,427 @@
+/**
+ * JTAG Boundary-Scan Functions
+ *
+ * Pin-level capture: the SAMPLE instruction is loaded once, and each DR scan
+ * then captures a snapshot of the FPGA's pins. Snapshots are packed into a ring
+ * buffer, from which the host reads them at its own pace.
+ *
+ * Interconnect test: the host describes the nets between boundary cells, and
+ * the EXTEST engine generates the test patterns, drives them and checks the
+ * responses locally; only the nets which failed are reported.
+ */
+
+#include "core.h"
+#include "fpga.h"
+#include "boundary.h"
+
+#include <string.h>
+
+#ifdef BOUNDARY_SCAN
+
+//True iff snapshots are being captured.
+static bool sample_running = false;
+
+//The window of the boundary register which is captured: the number of cells
+//skipped (those nearest TDO), and the number of cells kept after them.
+static uint16_t sample_skip_bits;
+static uint16_t sample_bits;
+
+//Boundary data buffers. Captures and interconnect tests are never run at
+//the same time, so they share this memory.
+static union
+{
+	//Snapshot ring buffer. Each snapshot is the 16-bit timestamp of its capture,
+	//followed by the captured cells, packed LSB first starting with the cell nearest TDO.
+	uint8_t ring[BOUNDARY_RING_SIZE];
+
+	//EXTEST vectors: the safe vector (with the tested cells overwritten by the
+	//current pattern) and the captured response.
+	struct
+	{
+		uint8_t vector[BOUNDARY_MAX_BITS / 8];
+		uint8_t response[BOUNDARY_MAX_BITS / 8];
+	} extest;
+} boundary_buffer;
+
+#define sample_ring boundary_buffer.ring
+static uint16_t sample_head;
+static uint16_t sample_count;
+
+//Capture statistics.
+static uint32_t sample_total;
+static uint32_t sample_ticks;
+static uint16_t sample_last_timestamp;
+
+//Length of the boundary register under EXTEST, in bits; or zero if no safe vector is loaded.
+static uint16_t extest_bits = 0;
+
+//The nets under test.
+static extest_net extest_nets[EXTEST_MAX_NETS];
+static uint8_t extest_net_count = 0;
+
+/*
+ * sample_put
+ *
+ * Appends a single byte to the snapshot ring.
+ */
+static void sample_put(uint8_t c)
+{
+	sample_ring[(sample_head + sample_count) % BOUNDARY_RING_SIZE] = c;
+	++sample_count;
+}
+
+/*
+ * sample_shift_window
+ *
+ * Shifts a number of boundary cells out of the device, storing them in the
+ * snapshot ring if requested.
+ */
+static void sample_shift_window(uint16_t remaining, bool store, bool first, bool last)
+{
+	while(remaining)
+	{
+		char bits = (remaining > 8) ? 8 : remaining;
+		char c;
+
+		remaining -= bits;
+
+		c = jtag_shift_data(0x00, bits, first, last && !remaining);
+		first = false;
+
+		if(store)
+			sample_put(c);
+	}
+}
+
+/**
+ * boundary_sample_start
+ *
+ * Loads the SAMPLE instruction, and starts capturing snapshots of the boundary
+ * register. Snapshots are taken by boundary_sample_task.
+ *
+ * first_bit:	The first boundary cell to capture; cell zero is nearest TDO.
+ * bits:		The number of cells to capture in each snapshot.
+ *
+ * Returns: True iff capture was started.
+ */
+bool boundary_sample_start(uint16_t first_bit, uint16_t bits)
+{
+	if(!bits || bits > BOUNDARY_MAX_BITS)
+		return false;
+
+	sample_skip_bits = first_bit;
+	sample_bits = bits;
+
+	//the ring overwrites the EXTEST vectors
+	extest_bits = 0;
+
+	//start with an empty ring
+	sample_head = 0;
+	sample_count = 0;
+
+	sample_total = 0;
+	sample_ticks = 0;
+	sample_last_timestamp = TCNT1;
+
+	//SAMPLE only needs to be loaded once; each DR scan captures the pins anew
+	jtag_load_instruction(fpga_device.inst.sample, fpga_device.inst.ir_bits);
+
+	sample_running = true;
+	return true;
+}
+
+/**
+ * boundary_sample_task
+ *
+ * Small daemon 'thread' which captures a single snapshot, if capture is running
+ * and the ring has room. Should be called from the main loop.
+ *
+ * Capture ends if another instruction has been loaded since it started (commands
+ * which use the chain should stop it first, with boundary_sample_stop), so its
+ * scans never reach another register.
+ */
+void boundary_sample_task(void)
+{
+	uint16_t timestamp;
+
+	if(!sample_running)
+		return;
+
+	if(!jtag_instruction_loaded(fpga_device.inst.sample, fpga_device.inst.ir_bits))
+	{
+		sample_running = false;
+		return;
+	}
+
+	//the capture time is counted on every call, even while the ring is full, so the
+	//16-bit timer never wraps between updates
+	timestamp = TCNT1;
+	sample_ticks += (uint16_t)(timestamp - sample_last_timestamp);
+	sample_last_timestamp = timestamp;
+
+	//if the host isn't keeping up, wait for room in the ring
+	if(BOUNDARY_RING_SIZE - sample_count < 2 + (sample_bits + 7) / 8)
+		return;
+
+	//the pins are captured as the scan begins
+	sample_put(timestamp & 0xFF);
+	sample_put(timestamp >> 8);
+
+	//skip to the captured window, then shift it into the ring
+	sample_shift_window(sample_skip_bits, false, true, false);
+	sample_shift_window(sample_bits, true, !sample_skip_bits, true);
+
+	++sample_total;
+}
+
+/**
+ * boundary_sample_read
+ *
+ * Removes up to size bytes of snapshot data from the ring.
+ *
+ * Returns: The number of bytes read.
+ */
+uint8_t boundary_sample_read(uint8_t* buffer, uint8_t size)
+{
+	uint8_t count = 0;
+
+	while(count < size && sample_count)
+	{
+		buffer[count++] = sample_ring[sample_head];
+
+		sample_head = (sample_head + 1) % BOUNDARY_RING_SIZE;
+		--sample_count;
+	}
+
+	return count;
+}
+
+/**
+ * boundary_sample_stop
+ *
+ * Stops capture, discarding any snapshots which haven't been read.
+ *
+ * stats:	Receives the capture statistics; or null, if they aren't needed.
+ */
+void boundary_sample_stop(boundary_sample_stats* stats)
+{
+	uint32_t samples = sample_total;
+	uint32_t ticks = sample_ticks;
+
+	sample_running = false;
+	sample_count = 0;
+
+	if(!stats)
+		return;
+
+	stats->samples = sample_total;
+	stats->ticks = sample_ticks;
+
+	//scale the counts down as needed to keep the rate calculation in range
+	while(samples > 0x3FFFF)
+	{
+		samples >>= 1;
+		ticks >>= 1;
+	}
+
+	stats->samples_per_second = ticks ? (samples * BOUNDARY_TIMESTAMP_HZ) / ticks : 0;
+}
+
+/*
+ * extest_get_cell / extest_set_cell
+ *
+ * Access a single cell of an EXTEST vector.
+ */
+static bool extest_get_cell(const uint8_t* vector, uint16_t cell)
+{
+	return vector[cell >> 3] & (1 << (cell & 0x07));
+}
+
+static void extest_set_cell(uint8_t* vector, uint16_t cell, bool value)
+{
+	if(value)
+		vector[cell >> 3] |= 1 << (cell & 0x07);
+	else
+		vector[cell >> 3] &= ~(1 << (cell & 0x07));
+}
+
+/*
+ * extest_pattern_value
+ *
+ * Returns: the value driven onto the given net by the given pattern.
+ */
+static bool extest_pattern_value(uint8_t type, uint8_t index, uint8_t net)
+{
+	switch(type)
+	{
+		case EXTEST_WALKING_ONES:
+			return net == index;
+
+		case EXTEST_WALKING_ZEROS:
+			return net != index;
+
+		//counting: each net drives a unique code, one bit per pattern; codes start
+		//at one, so that no net is ever driven all-zeroes (or, see extest_run, all-ones)
+		default:
+			return ((net + 1) >> index) & 0x01;
+	}
+}
+
+/*
+ * extest_shift_vector
+ *
+ * Performs a single DR scan of the boundary register, shifting in the vector
+ * and capturing the response.
+ */
+static void extest_shift_vector(void)
+{
+	uint16_t remaining = extest_bits;
+	uint8_t i = 0;
+
+	while(remaining)
+	{
+		char bits = (remaining > 8) ? 8 : remaining;
+		remaining -= bits;
+
+		boundary_buffer.extest.response[i] = jtag_shift_data(boundary_buffer.extest.vector[i], bits, i == 0, !remaining);
+		++i;
+	}
+}
+
+/**
+ * extest_set_vector
+ *
+ * Loads part of the safe vector: the boundary register contents which disable
+ * every output driver. Tested cells are overwritten while a test runs.
+ *
+ * bits:	The length of the boundary register, in bits.
+ * offset:	The offset of this data into the vector, in bytes.
+ * length:	The length of this data, in bytes.
+ *
+ * Returns: True iff the data fits in the vector.
+ */
+bool extest_set_vector(uint16_t bits, uint8_t offset, uint8_t length, const uint8_t* data)
+{
+	if(!bits || bits > BOUNDARY_MAX_BITS || offset + length > (bits + 7) / 8)
+		return false;
+
+	extest_bits = bits;
+	memcpy(&boundary_buffer.extest.vector[offset], data, length);
+
+	return true;
+}
+
+/**
+ * extest_set_nets
+ *
+ * Describes some of the nets under test. The net count becomes first + count,
+ * so the nets should be set in order.
+ *
+ * Returns: True iff the nets fit in the map, and each of their cells fits in
+ * 			the largest boundary register.
+ */
+bool extest_set_nets(uint8_t first, uint8_t count, const extest_net* nets)
+{
+	if(first + count > EXTEST_MAX_NETS)
+		return false;
+
+	for(uint8_t net = 0; net < count; ++net)
+		if(nets[net].output >= BOUNDARY_MAX_BITS || nets[net].control >= BOUNDARY_MAX_BITS ||
+		   nets[net].input >= BOUNDARY_MAX_BITS)
+			return false;
+
+	memcpy(&extest_nets[first], nets, count * sizeof(extest_net));
+	extest_net_count = first + count;
+
+	return true;
+}
+
+/**
+ * extest_run
+ *
+ * Runs an interconnect test over the nets described by extest_set_nets.
+ * The FPGA is reset afterwards, which returns its pins to normal operation.
+ *
+ * pattern:		The pattern type; EXTEST_WALKING_ONES, EXTEST_WALKING_ZEROS or EXTEST_COUNTING.
+ * failures:	Receives a bitmap of the nets which failed, one bit per net, LSB first.
+ * 				Must have room for (EXTEST_MAX_NETS / 8) bytes.
+ * failed:		Receives the number of nets which failed.
+ *
+ * Returns: False if there's no safe vector or no nets to test (the vector is lost
+ * 			whenever a boundary-scan capture is started), or if a net's cells lie
+ * 			beyond the vector; in which case nothing was tested.
+ */
+bool extest_run(uint8_t pattern, uint8_t* failures, uint8_t* failed)
+{
+	uint8_t patterns;
+
+	memset(failures, 0, EXTEST_MAX_NETS / 8);
+	*failed = 0;
+
+	if(!extest_bits || !extest_net_count)
+		return false;
+
+	//the vector may have been shortened since the nets were set
+	for(uint8_t net = 0; net < extest_net_count; ++net)
+		if(extest_nets[net].output >= extest_bits || extest_nets[net].control >= extest_bits ||
+		   extest_nets[net].input >= extest_bits)
+			return false;
+
+	//determine the number of patterns required
+	if(pattern == EXTEST_COUNTING)
+	{
+		//enough bits to count to net_count + 1, without reaching all-ones
+		for(patterns = 1; (1 << patterns) < extest_net_count + 2; ++patterns);
+	}
+	else
+		patterns = extest_net_count;
+
+	//Each scan captures the response to the previous pattern while shifting in
+	//the next, so there's one more scan than there are patterns; the first
+	//pattern is preloaded, and the final scan restores the safe vector.
+	for(uint8_t index = 0; index <= patterns; ++index)
+	{
+		//apply the pattern to the tested cells
+		for(uint8_t net = 0; net < extest_net_count; ++net)
+		{
+			extest_set_cell(boundary_buffer.extest.vector, extest_nets[net].output,
+			                extest_pattern_value(pattern, index, net));
+			extest_set_cell(boundary_buffer.extest.vector, extest_nets[net].control,
+			                (index < patterns) ? EXTEST_CONTROL_ENABLE : !EXTEST_CONTROL_ENABLE);
+		}
+
+		//the first pattern is preloaded before EXTEST is selected,
+		//so the pins never drive stale data
+		if(index == 0)
+			jtag_load_instruction(fpga_device.inst.sample, fpga_device.inst.ir_bits);
+
+		extest_shift_vector();
+
+		if(index == 0)
+		{
+			jtag_load_instruction(fpga_device.inst.extest, fpga_device.inst.ir_bits);
+			continue;
+		}
+
+		//check the response to the previous pattern
+		for(uint8_t net = 0; net < extest_net_count; ++net)
+		{
+			bool expected = extest_pattern_value(pattern, index - 1, net);
+
+			if(extest_get_cell(boundary_buffer.extest.response, extest_nets[net].input) != expected)
+				failures[net >> 3] |= 1 << (net & 0x07);
+		}
+	}
+
+	//return the pins to normal operation
+	fpga_reset();
+
+	//and count the failures
+	for(uint8_t net = 0; net < extest_net_count; ++net)
+		if(extest_get_cell(failures, net))
+			++*failed;
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+//Boundary-scan functions; only built into BOUNDARY_SCAN builds (see unilab.h).
+
+//standard libs
+#include <stdint.h>
+#include <stdbool.h>
+
+//JTAG functions
+#include "core.h"
+
+//Size of the snapshot ring buffer, in bytes.
+#define BOUNDARY_RING_SIZE 512
+
+//Largest snapshot which can be captured, in bits.
+#define BOUNDARY_MAX_BITS 1024
+
+//Largest number of nets which can be tested by the EXTEST engine.
+#define EXTEST_MAX_NETS 64
+
+//Value of a boundary control cell which enables its output driver.
+//(For Xilinx devices, a control cell value of 1 disables the output.)
+#define EXTEST_CONTROL_ENABLE 0
+
+//EXTEST pattern types.
+#define EXTEST_WALKING_ONES  0x00
+#define EXTEST_WALKING_ZEROS 0x01
+#define EXTEST_COUNTING      0x02
+
+//Frequency of the snapshot timestamps (the status timer, Timer1), in Hz.
+#define BOUNDARY_TIMESTAMP_HZ 15625UL
+
+//Boundary capture statistics, as returned by boundary_sample_stop.
+typedef struct
+{
+	uint32_t samples;		/* snapshots captured */
+	uint32_t ticks;			/* capture time, in timestamp ticks */
+	uint32_t samples_per_second;
+} boundary_sample_stats;
+
+//A single net under EXTEST: the boundary cells which drive it (output and
+//output enable) and the cell which senses it at the other end.
+typedef struct
+{
+	uint16_t output;
+	uint16_t control;
+	uint16_t input;
+} extest_net;
+
+#ifdef BOUNDARY_SCAN
+
+bool boundary_sample_start(uint16_t first_bit, uint16_t bits);
+void boundary_sample_task(void);
+uint8_t boundary_sample_read(uint8_t* buffer, uint8_t size);
+void boundary_sample_stop(boundary_sample_stats* stats);
+
+bool extest_set_vector(uint16_t bits, uint8_t offset, uint8_t length, const uint8_t* data);
+bool extest_set_nets(uint8_t first, uint8_t count, const extest_net* nets);
+bool extest_run(uint8_t pattern, uint8_t* failures, uint8_t* failed);
+
+#else
+
+//Without boundary scan, there's no capture to run or stop.
+static inline void boundary_sample_task(void)
+{
+}
+
+static inline void boundary_sample_stop(boundary_sample_stats* stats)
+{
+}
+
+#endif
@@ -6,15 +6,14 @@
  */
 
 #include "core.h"
+#include "../stats.h"
 
 #if !defined(NO_DELAY) || defined(BIT_DELAY)
 	#include <util/delay.h>
 #endif
 
-//#define DEBUG_JTAG
-
-#ifdef DEBUG_JTAG
-	#include <stdio.h>
+#ifdef JTAG_TRACE
+	#include <string.h>
 #endif
 
 //local 'private' (static) functions
@@ -26,13 +25,147 @@ char jtag_tap_state = 0;
 //Currently specified RUNTEST delay, in number of TCK cycles.
 char run_test_clocks = 0;
 
+//Called periodically during long operations, if set.
+void (*jtag_idle_callback)(void) = 0;
+
+//The instruction currently loaded (in the low byte) and its length (in the high
+//byte); or -1 if unknown. The PROM's instruction is always BYPASS, which is
+//loaded by the instruction header.
+static int16_t jtag_loaded_instruction = -1;
+
+#if JTAG_LANES > 1
+
+//All of the lanes' TDI pins.
+#define JTAG_LANE_TDI_BITS (JTAG_LANE_MASK << JTAG_LANE_TDI_PIN)
+
+//TDI while shifting a zero: the disabled lanes' pins are held high, which
+//shifts BYPASS into their instruction registers, and keeps them out of the way.
+static uint8_t jtag_lane_tdi_idle = 0;
+
+//Position of the selected lane's TDO pin, which provides the TDO seen by
+//single-lane shifts.
+static uint8_t jtag_lane_tdo_pin = JTAG_LANE_TDO_PIN;
+
+//All lanes' TDO, as sampled by the last tck_pulse.
+static uint8_t jtag_tdo_sample;
+
+//Drives TDI on every enabled lane, with a single port write.
+#define TDI_WRITE(bit) (JTAG_LANE_TDI_PORT = (JTAG_LANE_TDI_PORT & ~JTAG_LANE_TDI_BITS) | ((bit) ? JTAG_LANE_TDI_BITS : jtag_lane_tdi_idle))
+
+#else
+
+#define TDI_WRITE(bit) \
+	do { \
+		if(bit) \
+			JTAG_TDI_PORT |= 1 << JTAG_TDI_PIN; \
+		else \
+			JTAG_TDI_PORT &= ~(1 << JTAG_TDI_PIN); \
+	} while(0)
+
+#endif
+
+#ifdef JTAG_TRACE
+
+//Trace ring; when full, the oldest entries are overwritten.
+static jtag_trace_entry trace_ring[JTAG_TRACE_SIZE];
+static uint8_t trace_head = 0;
+static uint8_t trace_count = 0;
+
+//The entry of the DR scan in progress, if any.
+static jtag_trace_entry* trace_dr = 0;
+
+/*
+ * trace_put
+ *
+ * Appends an entry to the trace ring.
+ *
+ * Returns: The new entry.
+ */
+static jtag_trace_entry* trace_put(uint8_t type, uint8_t value, uint16_t data)
+{
+	jtag_trace_entry* entry = &trace_ring[(trace_head + trace_count) % JTAG_TRACE_SIZE];
+
+	if(trace_count == JTAG_TRACE_SIZE)
+		trace_head = (trace_head + 1) % JTAG_TRACE_SIZE;
+	else
+		++trace_count;
+
+	entry->type = type;
+	entry->value = value;
+	entry->data = data;
+
+	//any other operation ends the DR scan's entry
+	trace_dr = 0;
+
+	return entry;
+}
+
+#define TRACE(type, value, data) trace_put(type, value, data)
+
+/**
+ * jtag_trace_read
+ *
+ * Removes whole entries from the trace ring, oldest first.
+ *
+ * Returns: The number of bytes read.
+ */
+uint8_t jtag_trace_read(uint8_t* buffer, uint8_t size)
+{
+	uint8_t count = 0;
+
+	while(count + sizeof(jtag_trace_entry) <= size && trace_count)
+	{
+		memcpy(&buffer[count], &trace_ring[trace_head], sizeof(jtag_trace_entry));
+		count += sizeof(jtag_trace_entry);
+
+		trace_head = (trace_head + 1) % JTAG_TRACE_SIZE;
+		--trace_count;
+	}
+
+	//the scan in progress (if any) may have been read
+	trace_dr = 0;
+
+	return count;
+}
+
+/**
+ * jtag_trace_clear
+ *
+ * Discards the trace.
+ */
+void jtag_trace_clear(void)
+{
+	trace_count = 0;
+	trace_dr = 0;
+}
+
+#else
+
+#define TRACE(type, value, data)
+
+uint8_t jtag_trace_read(uint8_t* buffer, uint8_t size)
+{
+	return 0;
+}
+
+void jtag_trace_clear(void)
+{
+}
+
+#endif
+
 void jtag_initialize()
 {
         //set the polarity of the JTAG pins
         JTAG_TMS_DDR |= 1 << JTAG_TMS_PIN;
         JTAG_TCK_DDR |= 1 << JTAG_TCK_PIN;
+#if JTAG_LANES > 1
+        JTAG_LANE_TDI_DDR |= JTAG_LANE_TDI_BITS;
+        JTAG_LANE_TDO_DDR &= ~(JTAG_LANE_MASK << JTAG_LANE_TDO_PIN);
+#else
         JTAG_TDI_DDR |= 1 << JTAG_TDI_PIN;
         JTAG_TDO_DDR &= ~(1 << JTAG_TDO_PIN);
+#endif
 
 
 }
@@ -60,7 +193,12 @@ static char tck_pulse(void)
 	#endif
 
 	//read TDO, for convenience
+#if JTAG_LANES > 1
+	jtag_tdo_sample = JTAG_LANE_TDO_PORT;
+	tdo = 0x01 & (jtag_tdo_sample >> jtag_lane_tdo_pin);
+#else
 	tdo = 0x01 & (JTAG_TDO_PORT >> JTAG_TDO_PIN);
+#endif
 
 	//set TCK high, and then idle for TCK_HIGH
 	JTAG_TCK_PORT |= 1 << JTAG_TCK_PIN;
@@ -77,6 +215,34 @@ static char tck_pulse(void)
 	return tdo;
 }
 
+/*
+ * tck_cycle
+ *
+ * As tck_pulse, but without sampling TDO; for the block shift's inner loop.
+ */
+static inline void tck_cycle(void)
+{
+	JTAG_TCK_PORT &= ~(1 << JTAG_TCK_PIN);
+
+	#ifndef JTAG_NO_DELAY
+		#ifndef JTAG_SLOW_CLOCK
+			_delay_us(JTAG_TCK_LOW);
+		#else
+			_delay_ms(JTAG_TCK_LOW);
+		#endif
+	#endif
+
+	JTAG_TCK_PORT |= 1 << JTAG_TCK_PIN;
+
+	#ifndef JTAG_NO_DELAY
+		#ifndef JTAG_SLOW_CLOCK
+			_delay_us(JTAG_TCK_HIGH);
+		#else
+			_delay_ms(JTAG_TCK_HIGH);
+		#endif
+	#endif
+}
+
 /*
  * TMS Advance convenience function.
  *
@@ -114,9 +280,8 @@ static char tms_advance(char tms)
  */
 void tap_set_state(char new_state)
 {
-#ifdef DEBUG_JTAG
-	printf("Changing state to %x.\n", new_state);
-#endif
+	if(new_state != jtag_tap_state)
+		TRACE(JTAG_TRACE_STATE, new_state, jtag_tap_state);
 
 
 	//Handle device resets independently of emulated FSM.
@@ -159,10 +324,6 @@ void tap_set_state(char new_state)
 
 	while(jtag_tap_state != new_state)
 	{
-#ifdef DEBUG_JTAG
-		//printf("Iterated. State is: %x. TMS is %x.\n", jtag_tap_state, 1 & (PORTB >> TMS));
-#endif
-
 		//FSM
 		switch(jtag_tap_state)
 		{
@@ -383,10 +544,6 @@ void tap_set_state(char new_state)
 				break;
 		}
 	}
-
-#ifdef DEBUG_JTAG
-	//printf("State changed.\n\n");
-#endif
 }
 
 /*
@@ -401,9 +558,10 @@ void tms_reset(void)
 	//set the TMS pin high
 	tms_set(1);
 
-#ifdef DEBUG_JTAG
-	printf("Resetting chain...\n");
-#endif
+	TRACE(JTAG_TRACE_RESET, 0, 0);
+
+	//reset loads the devices' default instructions
+	jtag_loaded_instruction = -1;
 
 	//and clock five times
 	for(int i=0; i < 5; ++i)
@@ -454,19 +612,32 @@ inline void jtag_instruction_trailer(void)
  * 			and will be suffixed with the appropriate trailers.
  * 			The device will move to the EXIT1 state.
  *
+ * Returns: The bits captured in the instruction register, which
+ * 			typically include the device's status.
+ *
  */
-void jtag_shift_instruction(char c, char bits, char first, char last)
+char jtag_shift_instruction(char c, char bits, char first, char last)
 {
+	char buffer;
+
 	//prepare the device for instruction input
 	if(first)
 	{
 		tap_set_state(TAP_STATE_SHIFTIR);
 		jtag_instruction_header();
+
+		jtag_loaded_instruction = -1;
 	}
 
 	//and shift the instructions
 	//FIXME: handle trailer(?)
-	jtag_shift_char(c, bits, last);
+	buffer = jtag_shift_char(c, bits, last);
+
+	TRACE(JTAG_TRACE_IR, c, bits | ((uint16_t)(uint8_t)buffer << 8));
+
+	//single-character instructions are remembered, so they needn't be reloaded
+	if(first && last)
+		jtag_loaded_instruction = (uint8_t)c | ((uint16_t)bits << 8);
 
 	//if there's no more to shift, send the trailer
 	if(last)
@@ -474,6 +645,51 @@ void jtag_shift_instruction(char c, char bits, char first, char last)
 		jtag_instruction_trailer();
 		//tap_set_state(TAP_STATE_IDLE); //TODO: possibly remove
 	}
+
+	return buffer;
+}
+
+/**
+ * jtag_load_instruction
+ *
+ * Loads a single-character instruction, unless it's already loaded. Use
+ * jtag_shift_instruction instead when the IR capture (i.e. the device's
+ * status) is needed, or when the instruction must be reloaded to take effect.
+ *
+ * c:		The instruction.
+ * bits:	The length of the instruction, 8 or less.
+ *
+ * Returns: True iff the instruction was shifted.
+ */
+char jtag_load_instruction(char c, char bits)
+{
+	if(jtag_loaded_instruction == ((uint8_t)c | ((uint16_t)bits << 8)))
+		return 0;
+
+	jtag_shift_instruction(c, bits, 1, 1);
+	return 1;
+}
+
+/**
+ * jtag_instruction_loaded
+ *
+ * Returns: Nonzero iff the instruction is known to be loaded; for code which runs
+ * scans between other users of the chain, and must check it's still theirs.
+ */
+char jtag_instruction_loaded(char c, char bits)
+{
+	return jtag_loaded_instruction == ((uint8_t)c | ((uint16_t)bits << 8));
+}
+
+/**
+ * jtag_invalidate_instruction
+ *
+ * Forgets the loaded instruction, so the next jtag_load_instruction shifts it;
+ * for use when the devices' instructions may have changed behind our back.
+ */
+void jtag_invalidate_instruction(void)
+{
+	jtag_loaded_instruction = -1;
 }
 
 inline void jtag_data_header(void)
@@ -491,12 +707,22 @@ inline void jtag_data_trailer(void)
 //Stay in the Run-Test state for a set amount of clocks
 void run_test(long clocks)
 {
+	uint32_t start = stats_now();
+
 	//set the state to run test
 	tap_set_state(TAP_STATE_RUNTEST);
 
 	//and send the set amount of clocks
 	for(long i = 0; i < clocks; ++i)
+	{
 		tck_pulse();
+
+		//let the rest of the system run during long waits
+		if(jtag_idle_callback && (i & (JTAG_IDLE_INTERVAL - 1)) == JTAG_IDLE_INTERVAL - 1)
+			jtag_idle_callback();
+	}
+
+	stats_add(STATS_RUN_TEST, start);
 }
 
 /**
@@ -529,6 +755,17 @@ char jtag_shift_data(char c, char bits, char first, char last)
 	//FIXME: handle trailer
 	buffer = jtag_shift_char(c, bits, last);
 
+	#ifdef JTAG_TRACE
+		//each scan gets a single entry, which counts its bits
+		if(first || !trace_dr)
+			trace_dr = trace_put(JTAG_TRACE_DR, 0, 0);
+
+		trace_dr->value = buffer;
+
+		if(trace_dr->data < 0xFFFF - 8)
+			trace_dr->data += bits;
+	#endif
+
 
 	//if there's no more to shift, send the trailer and
 	//return to the idle state
@@ -541,6 +778,270 @@ char jtag_shift_data(char c, char bits, char first, char last)
 	return buffer;
 }
 
+/**
+ * jtag_reverse
+ *
+ * Returns: The character with its bits in the opposite order; converts between
+ * data sent LSB first and MSB first.
+ */
+uint8_t jtag_reverse(uint8_t c)
+{
+	c = (c >> 4) | (c << 4);
+	c = ((c & 0xCC) >> 2) | ((c & 0x33) << 2);
+	c = ((c & 0xAA) >> 1) | ((c & 0x55) << 1);
+
+	return c;
+}
+
+/*
+ * jtag_shift_byte_fast
+ *
+ * Shifts all eight bits of a byte, without leaving Shift-DR, and discarding
+ * the data received. Always inlined, so msb_first is a constant.
+ */
+static inline void jtag_shift_byte_fast(uint8_t c, const char msb_first) __attribute__((always_inline));
+static inline void jtag_shift_byte_fast(uint8_t c, const char msb_first)
+{
+	for(uint8_t bit = 0; bit < 8; ++bit)
+	{
+		if(msb_first)
+		{
+			TDI_WRITE(c & 0x80);
+			c <<= 1;
+		}
+		else
+		{
+			TDI_WRITE(c & 0x01);
+			c >>= 1;
+		}
+
+		#ifdef JTAG_BIT_DELAY
+			#ifdef JTAG_SLOW_CLOCK
+				_delay_ms(JTAG_BIT_DELAY);
+			#else
+				_delay_us(JTAG_BIT_DELAY);
+			#endif
+		#endif
+
+		tck_cycle();
+	}
+}
+
+/*
+ * jtag_shift_last_byte
+ *
+ * Shifts the final byte of a scan, leaving Shift-DR.
+ */
+static void jtag_shift_last_byte(uint8_t c, char msb_first)
+{
+	jtag_shift_char(msb_first ? jtag_reverse(c) : c, 8, 1);
+	jtag_data_trailer();
+}
+
+static inline void jtag_shift_block_order(const uint8_t* data, uint16_t length, char first, char last, const char msb_first) __attribute__((always_inline));
+static inline void jtag_shift_block_order(const uint8_t* data, uint16_t length, char first, char last, const char msb_first)
+{
+	uint32_t start;
+
+	if(!length)
+		return;
+
+	if(first)
+	{
+		tap_set_state(TAP_STATE_SHIFTDR);
+		jtag_data_header();
+	}
+
+	start = stats_now();
+
+	//the final byte of the scan is left to jtag_shift_char, which leaves Shift-DR
+	if(last)
+		--length;
+
+	for(uint16_t i = 0; i < length; ++i)
+		jtag_shift_byte_fast(data[i], msb_first);
+
+	stats_add(STATS_JTAG_SHIFT, start);
+
+	if(last)
+		jtag_shift_last_byte(data[length], msb_first);
+
+	#ifdef JTAG_TRACE
+		if(first || !trace_dr)
+			trace_dr = trace_put(JTAG_TRACE_DR, 0, 0);
+
+		if(trace_dr->data < 0xFFFF - 8 * (length + last))
+			trace_dr->data += 8 * (length + last);
+	#endif
+}
+
+static inline void jtag_shift_stream_order(jtag_byte_source source, uint32_t length, char first, char last, const char msb_first) __attribute__((always_inline));
+static inline void jtag_shift_stream_order(jtag_byte_source source, uint32_t length, char first, char last, const char msb_first)
+{
+	uint32_t start;
+
+	if(!length)
+		return;
+
+	if(first)
+	{
+		tap_set_state(TAP_STATE_SHIFTDR);
+		jtag_data_header();
+	}
+
+	start = stats_now();
+
+	//the final byte of the scan is left to jtag_shift_char, which leaves Shift-DR
+	if(last)
+		--length;
+
+	for(uint32_t i = 0; i < length; ++i)
+	{
+		jtag_shift_byte_fast(source(), msb_first);
+
+		//the source may take a while to refill, so let the rest of the system run
+		if(jtag_idle_callback && (i & (JTAG_IDLE_INTERVAL - 1)) == JTAG_IDLE_INTERVAL - 1)
+			jtag_idle_callback();
+	}
+
+	stats_add(STATS_JTAG_SHIFT, start);
+
+	if(last)
+		jtag_shift_last_byte(source(), msb_first);
+
+	#ifdef JTAG_TRACE
+		if(first || !trace_dr)
+			trace_dr = trace_put(JTAG_TRACE_DR, 0, 0);
+
+		//long streams saturate the entry's bit count
+		if(8 * (length + last) < (uint32_t)(0xFFFF - trace_dr->data))
+			trace_dr->data += 8 * (length + last);
+		else
+			trace_dr->data = 0xFFFF;
+	#endif
+}
+
+/**
+ * jtag_shift_block
+ *
+ * Sends a block of data to the target device, discarding the data received.
+ * Equivalent to calling jtag_shift_data for each byte, but every byte except the
+ * last of a scan is shifted by a tight inner loop, without per-byte calls or flags.
+ *
+ * data:	The data to be sent, each byte LSB first.
+ * length:	The number of bytes to send.
+ * first:	If nonzero, this block starts the data, and is prefixed with the
+ * 			appropriate headers.
+ * last:	If nonzero, this block ends the data; the device will move to the
+ * 			EXIT1 state.
+ */
+void jtag_shift_block(const uint8_t* data, uint16_t length, char first, char last)
+{
+	jtag_shift_block_order(data, length, first, last, 0);
+}
+
+/**
+ * jtag_shift_block_msb
+ *
+ * As jtag_shift_block, but each byte is sent MSB first; the order in which
+ * Xilinx configuration files store the bitstream.
+ */
+void jtag_shift_block_msb(const uint8_t* data, uint16_t length, char first, char last)
+{
+	jtag_shift_block_order(data, length, first, last, 1);
+}
+
+/**
+ * jtag_shift_stream
+ *
+ * As jtag_shift_block, but each byte is fetched from a source just before it's
+ * shifted, so long data (such as a bitstream read from storage) needn't be
+ * buffered. The source is called once per byte, in order; a source driven by a
+ * peripheral can start fetching the following byte before returning, which then
+ * proceeds while this byte is shifted. The idle callback is run periodically.
+ *
+ * source:	Returns each byte to be sent, LSB first.
+ * length:	The number of bytes to send.
+ * first:	If nonzero, prefixes the data with the appropriate headers.
+ * last:	If nonzero, the device will move to the EXIT1 state after the data.
+ */
+void jtag_shift_stream(jtag_byte_source source, uint32_t length, char first, char last)
+{
+	jtag_shift_stream_order(source, length, first, last, 0);
+}
+
+/**
+ * jtag_shift_stream_msb
+ *
+ * As jtag_shift_stream, but each byte is sent MSB first.
+ */
+void jtag_shift_stream_msb(jtag_byte_source source, uint32_t length, char first, char last)
+{
+	jtag_shift_stream_order(source, length, first, last, 1);
+}
+
+/**
+ * jtag_read_stream_msb
+ *
+ * Receives data from the target device, handing each byte to a sink as soon as
+ * it's complete, so long data (such as configuration readback) needn't be
+ * buffered. Each byte is received MSB first; ones are sent meanwhile. The idle
+ * callback is run periodically.
+ *
+ * sink:	Receives each byte, in order.
+ * length:	The number of bytes to receive.
+ * first:	If nonzero, prefixes the data with the appropriate headers.
+ * last:	If nonzero, the device will move to the EXIT1 state after the data,
+ * 			with one further clock.
+ */
+void jtag_read_stream_msb(jtag_byte_sink sink, uint32_t length, char first, char last)
+{
+	uint32_t start;
+
+	if(first)
+	{
+		tap_set_state(TAP_STATE_SHIFTDR);
+		jtag_data_header();
+	}
+
+	start = stats_now();
+
+	TDI_WRITE(1);
+
+	for(uint32_t i = 0; i < length; ++i)
+	{
+		uint8_t c = 0;
+
+		for(uint8_t bit = 0; bit < 8; ++bit)
+			c = (c << 1) | tck_pulse();
+
+		sink(c);
+
+		//the sink may take a while, so let the rest of the system run
+		if(jtag_idle_callback && (i & (JTAG_IDLE_INTERVAL - 1)) == JTAG_IDLE_INTERVAL - 1)
+			jtag_idle_callback();
+	}
+
+	stats_add(STATS_JTAG_SHIFT, start);
+
+	//every bit was received in the loop; the exit only discards one more
+	if(last)
+	{
+		jtag_shift_char(0xFF, 1, 1);
+		jtag_data_trailer();
+	}
+
+	#ifdef JTAG_TRACE
+		if(first || !trace_dr)
+			trace_dr = trace_put(JTAG_TRACE_DR, 0, 0);
+
+		if(8 * length + last < (uint32_t)(0xFFFF - trace_dr->data))
+			trace_dr->data += 8 * length + last;
+		else
+			trace_dr->data = 0xFFFF;
+	#endif
+}
+
 /*
  * jtag_shift_char
  *
@@ -554,6 +1055,7 @@ char jtag_shift_data(char c, char bits, char first, char last)
  */
 static char jtag_shift_char(char c, char bits, char advance)
 {
+	uint16_t start = stats_mark();
 	char in = 0;
 
 	//send each bit in the char
@@ -562,10 +1064,7 @@ static char jtag_shift_char(char c, char bits, char advance)
 	{
 
 		//output each bit, one by one
-		if(c & (1 << i))
-			JTAG_TDI_PORT |= 1 << JTAG_TDI_PIN;
-		else
-			JTAG_TDI_PORT &= ~(1 << JTAG_TDI_PIN);
+		TDI_WRITE(c & (1 << i));
 
 
 
@@ -594,10 +1093,106 @@ static char jtag_shift_char(char c, char bits, char advance)
 
 	}
 
-	#ifdef DEBUG_JTAG
-		printf("Shifted out %d bits of %x, received %x.\n", bits, c, in);
-	#endif
+	stats_add_short(STATS_JTAG_SHIFT, start);
 
 	//return the character received
 	return in;
 }
+
+/**
+ * jtag_set_lanes
+ *
+ * Selects the JTAG lanes which are driven; all enabled lanes receive the same
+ * data from the single-lane shifts, so identical targets can be configured in
+ * parallel. Disabled lanes are placed in BYPASS by the next IR scan.
+ *
+ * enabled:		A bitmask of the lanes to enable; lane zero is the LSB.
+ * selected:	The lane whose TDO is seen by the single-lane shifts (and
+ * 				so, for instance, by status polls). Must be enabled.
+ *
+ * Returns: True iff the lanes are valid for this board.
+ */
+char jtag_set_lanes(uint8_t enabled, uint8_t selected)
+{
+	if(!enabled || (enabled & ~JTAG_LANE_MASK) || selected >= JTAG_LANES || !(enabled & (1 << selected)))
+		return 0;
+
+#if JTAG_LANES > 1
+	jtag_lane_tdi_idle = (~enabled & JTAG_LANE_MASK) << JTAG_LANE_TDI_PIN;
+	jtag_lane_tdo_pin = JTAG_LANE_TDO_PIN + selected;
+#endif
+
+	//the newly-enabled lanes may have a different instruction loaded
+	jtag_loaded_instruction = -1;
+
+	return 1;
+}
+
+/**
+ * jtag_shift_lanes
+ *
+ * Sends a separate character of data to each lane, receiving a character from
+ * each. The lanes' bits are sliced across the TDI port, so each TCK cycle takes
+ * a single port write, however many lanes there are.
+ *
+ * out:		One character for each lane, LSB first.
+ * in:		Receives one character from each lane.
+ * bits:	The number of bits to send, 8 or less.
+ * first:	If nonzero, starts a DR scan.
+ * last:	If nonzero, ends the DR scan; the devices move to the EXIT1 state.
+ */
+void jtag_shift_lanes(const uint8_t* out, uint8_t* in, char bits, char first, char last)
+{
+#if JTAG_LANES > 1
+	uint16_t start = stats_mark();
+	uint8_t slices[8];
+
+	//transpose the characters into bit slices: slice i holds bit i of every lane
+	for(uint8_t i = 0; i < bits; ++i)
+	{
+		uint8_t slice = 0;
+
+		for(uint8_t lane = 0; lane < JTAG_LANES; ++lane)
+			if(out[lane] & (1 << i))
+				slice |= 1 << lane;
+
+		slices[i] = (slice << JTAG_LANE_TDI_PIN) | jtag_lane_tdi_idle;
+	}
+
+	for(uint8_t lane = 0; lane < JTAG_LANES; ++lane)
+		in[lane] = 0;
+
+	if(first)
+	{
+		tap_set_state(TAP_STATE_SHIFTDR);
+		jtag_data_header();
+	}
+
+	for(uint8_t i = 0; i < bits; ++i)
+	{
+		uint8_t tdo;
+
+		JTAG_LANE_TDI_PORT = (JTAG_LANE_TDI_PORT & ~JTAG_LANE_TDI_BITS) | slices[i];
+
+		//if this is the last bit, advance to the exit point at the same time
+		if(last && i == bits - 1)
+		{
+			tms_advance(1);
+			++jtag_tap_state;
+		}
+		else
+			tck_pulse();
+
+		//and gather each lane's TDO
+		tdo = jtag_tdo_sample >> JTAG_LANE_TDO_PIN;
+
+		for(uint8_t lane = 0; lane < JTAG_LANES; ++lane)
+			if(tdo & (1 << lane))
+				in[lane] |= 1 << i;
+	}
+
+	stats_add_short(STATS_JTAG_SHIFT, start);
+#else
+	in[0] = jtag_shift_data(out[0], bits, first, last);
+#endif
+}
@@ -78,11 +78,72 @@ typedef char tap_state;
 #define TAP_STATE_EXIT2IR   	0x0E
 #define TAP_STATE_UPDATEIR  	0x0F
 
+//Number of TCK cycles between calls to the idle callback during run_test; must be a power of two.
+#define JTAG_IDLE_INTERVAL 1024
+
+//Called periodically during long operations (such as run_test), if set.
+//The callback must not use the JTAG chain.
+extern void (*jtag_idle_callback)(void);
+
+//Source of the data for jtag_shift_stream; returns the next byte to be sent.
+typedef uint8_t (*jtag_byte_source)(void);
+
+//Destination of the data from jtag_read_stream_msb; receives each byte in turn.
+typedef void (*jtag_byte_sink)(uint8_t c);
+
+//Multi-lane JTAG (see unilab.h); a single lane unless the board defines more.
+#ifndef JTAG_LANES
+	#define JTAG_LANES 1
+#endif
+
+#define JTAG_LANE_MASK ((1 << JTAG_LANES) - 1)
+
+#if JTAG_LANES > 8
+	#error At most eight JTAG lanes are supported.
+#endif
+
+//JTAG trace recorder.
+//
+//If JTAG_TRACE is defined (see unilab.h), the most recent JTAG operations are
+//recorded in a ring of JTAG_TRACE_SIZE packed entries, which can be read back
+//with jtag_trace_read. Consecutive bytes of a DR scan share a single entry.
+#ifndef JTAG_TRACE_SIZE
+	#define JTAG_TRACE_SIZE 32
+#endif
+
+//Trace entry types.
+#define JTAG_TRACE_RESET 0x01	/* TMS reset */
+#define JTAG_TRACE_STATE 0x02	/* TAP state change; value is the new state, data the old */
+#define JTAG_TRACE_IR    0x03	/* IR scan; value is the instruction, data the length (low byte) and capture (high byte) */
+#define JTAG_TRACE_DR    0x04	/* DR scan; value is the last byte received, data the length in bits */
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t value;
+	uint16_t data;
+} jtag_trace_entry;
+
+uint8_t jtag_trace_read(uint8_t* buffer, uint8_t size);
+void jtag_trace_clear(void);
+
+char jtag_set_lanes(uint8_t enabled, uint8_t selected);
+void jtag_shift_lanes(const uint8_t* out, uint8_t* in, char bits, char first, char last);
+
 //JTAG functions
 void tms_set(char value);
 void tms_reset(void);
-void jtag_shift_instruction(char c, char bits, char first, char last);
+char jtag_shift_instruction(char c, char bits, char first, char last);
+char jtag_load_instruction(char c, char bits);
+char jtag_instruction_loaded(char c, char bits);
+void jtag_invalidate_instruction(void);
 char jtag_shift_data(char c, char bits, char first, char last);
+void jtag_shift_block(const uint8_t* data, uint16_t length, char first, char last);
+void jtag_shift_stream(jtag_byte_source source, uint32_t length, char first, char last);
+uint8_t jtag_reverse(uint8_t c);
+void jtag_shift_block_msb(const uint8_t* data, uint16_t length, char first, char last);
+void jtag_shift_stream_msb(jtag_byte_source source, uint32_t length, char first, char last);
+void jtag_read_stream_msb(jtag_byte_sink sink, uint32_t length, char first, char last);
 void jtag_initialize(void);
 void tap_set_state(char);
 void run_test(long clocks);
@@ -0,0 +1,105 @@
+/**
+ * FPGA Device Database
+ *
+ * A compact table of the supported FPGAs, keyed by IDCODE and stored in
+ * program memory. Each device refers to its family, which gives the instruction
+ * set and configuration sequence.
+ *
+ * The families share their instructions, but not their configuration sequence:
+ * the Spartan-3E is polled for INIT_B under CFG_IN, and wants 95 zeroes shifted
+ * before the bitstream; the Spartan-6 is polled under ISC_NOOP, as its
+ * configuration logic isn't ready for CFG_IN until the memory has cleared, and
+ * its bitstream's own padding is enough.
+ */
+
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "devices.h"
+
+#ifdef FPGA_DEVICE_TABLE
+
+//Families, indexed by FPGA_FAMILY constant.
+static const fpga_family PROGMEM families[] =
+{
+	//Spartan-3E
+	{
+		.inst =
+		{
+			.ir_bits = 6, .idcode = 0x09, .bypass = 0x3F,
+			.jprogram = 0x0B, .cfg_in = 0x05, .cfg_out = 0x04, .jstart = 0x0C,
+			.user1 = 0x02, .user2 = 0x03, .sample = 0x01, .extest = 0x0F
+		},
+		.config = { .init_poll = 0x05, .flush_bits = 95 }
+	},
+
+	//Spartan-6
+	{
+		.inst =
+		{
+			.ir_bits = 6, .idcode = 0x09, .bypass = 0x3F,
+			.jprogram = 0x0B, .cfg_in = 0x05, .cfg_out = 0x04, .jstart = 0x0C,
+			.user1 = 0x02, .user2 = 0x03, .sample = 0x01, .extest = 0x0F
+		},
+		.config = { .init_poll = 0x14, .flush_bits = 0 }
+	},
+};
+
+//Known devices.
+static const fpga_part PROGMEM devices[] =
+{
+	//Spartan-3E
+	{ 0x01C10093, FPGA_FAMILY_SPARTAN3E,   581344,  2000, 8 },	/* XC3S100E */
+	{ 0x01C1A093, FPGA_FAMILY_SPARTAN3E,  1353728,  4000, 8 },	/* XC3S250E */
+	{ 0x01C22093, FPGA_FAMILY_SPARTAN3E,  2270208,  6000, 8 },	/* XC3S500E */
+	{ 0x01C2E093, FPGA_FAMILY_SPARTAN3E,  3841184, 10000, 8 },	/* XC3S1200E */
+	{ 0x01C3A093, FPGA_FAMILY_SPARTAN3E,  5969696, 14000, 8 },	/* XC3S1600E */
+
+	//Spartan-6
+	{ 0x04000093, FPGA_FAMILY_SPARTAN6,   2724832,  4000, 8 },	/* XC6SLX4 */
+	{ 0x04001093, FPGA_FAMILY_SPARTAN6,   2724832,  4000, 8 },	/* XC6SLX9 */
+	{ 0x04002093, FPGA_FAMILY_SPARTAN6,   3731264,  5000, 8 },	/* XC6SLX16 */
+	{ 0x04004093, FPGA_FAMILY_SPARTAN6,   6440432,  8000, 8 },	/* XC6SLX25 */
+	{ 0x04008093, FPGA_FAMILY_SPARTAN6,  11939296, 14000, 8 },	/* XC6SLX45 */
+};
+
+//Used for unknown devices: the Spartan-3E family, with worst-case timing and no
+//known bitstream length.
+static const fpga_part PROGMEM unknown_device =
+	{ 0x00000000, FPGA_FAMILY_SPARTAN3E, 0, 14000, 8 };
+
+/**
+ * device_lookup
+ *
+ * Finds the device with the given IDCODE.
+ *
+ * idcode:	The IDCODE read from the device; the revision is ignored.
+ * info:	Receives the device's parameters, instruction set and configuration
+ * 			sequence. If the device is unknown, receives a conservative default.
+ *
+ * Returns: True iff the device is known.
+ */
+bool device_lookup(uint32_t idcode, fpga_device_info* info)
+{
+	bool found = false;
+
+	idcode &= FPGA_IDCODE_MASK;
+
+	memcpy_P(&info->part, &unknown_device, sizeof(fpga_part));
+
+	for(uint8_t i = 0; i < sizeof(devices) / sizeof(fpga_part); ++i)
+	{
+		if(pgm_read_dword(&devices[i].idcode) == idcode)
+		{
+			memcpy_P(&info->part, &devices[i], sizeof(fpga_part));
+			found = true;
+			break;
+		}
+	}
+
+	memcpy_P(&info->inst, &families[info->part.family].inst, sizeof(fpga_instruction_set));
+	memcpy_P(&info->config, &families[info->part.family].config, sizeof(fpga_config_sequence));
+	return found;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+//FPGA device database; the table is only built into FPGA_DEVICE_TABLE builds
+//(see unilab.h).
+
+//standard libs
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../unilab.h"
+
+//FPGA families
+#define FPGA_FAMILY_SPARTAN3E 0x00
+#define FPGA_FAMILY_SPARTAN6  0x01
+
+//Mask applied to IDCODEs before lookup; removes the revision bits (31:28).
+#define FPGA_IDCODE_MASK 0x0FFFFFFFUL
+
+//The JTAG instruction set of an FPGA family.
+typedef struct
+{
+	uint8_t ir_bits;
+	uint8_t idcode;
+	uint8_t bypass;
+	uint8_t jprogram;
+	uint8_t cfg_in;
+	uint8_t cfg_out;
+	uint8_t jstart;
+	uint8_t user1;
+	uint8_t user2;
+	uint8_t sample;
+	uint8_t extest;
+} fpga_instruction_set;
+
+//How an FPGA family is configured over JTAG, beyond its instructions.
+typedef struct
+{
+	uint8_t init_poll;		/* instruction shifted to poll INIT_B while the memory clears */
+	uint8_t flush_bits;		/* zeroes shifted into CFG_IN before the bitstream */
+} fpga_config_sequence;
+
+//An FPGA family.
+typedef struct
+{
+	fpga_instruction_set inst;
+	fpga_config_sequence config;
+} fpga_family;
+
+//A single FPGA part.
+typedef struct
+{
+	uint32_t idcode;		/* IDCODE, masked with FPGA_IDCODE_MASK */
+	uint8_t family;			/* FPGA_FAMILY constant */
+	uint32_t bitstream_bits;	/* length of a full configuration bitstream; zero if unknown */
+	uint16_t init_clocks;		/* minimum TCK cycles for the memory clear after JPROGRAM */
+	uint16_t startup_clocks;	/* minimum TCK cycles from JSTART until DONE */
+} fpga_part;
+
+//Everything needed to drive the FPGA; as found by device_lookup.
+typedef struct
+{
+	fpga_part part;
+	fpga_instruction_set inst;
+	fpga_config_sequence config;
+} fpga_device_info;
+
+#ifdef FPGA_DEVICE_TABLE
+
+bool device_lookup(uint32_t idcode, fpga_device_info* info);
+
+#else
+
+//Without the table, the FPGA keeps the Spartan-3E defaults (see fpga_device).
+static inline bool device_lookup(uint32_t idcode, fpga_device_info* info)
+{
+	return false;
+}
+
+#endif
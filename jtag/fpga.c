@@ -2,9 +2,70 @@
 //JTAG
 #include "core.h"
 #include "fpga.h"
+#include "bitstream.h"
 
 #include <stdbool.h>
 
+//The USER register selected for host transfers, if any.
+static char user_selected = 0;
+
+//True iff a DR scan of the USER register is in progress.
+static bool user_scan_open = false;
+
+//Wait times of the last configuration.
+fpga_config_timing fpga_timing;
+
+//The FPGA on the chain; until it's identified, a Spartan-3E is assumed.
+fpga_device_info fpga_device =
+{
+	.part = { 0, FPGA_FAMILY_SPARTAN3E, 0, 0, 0 },
+	.inst =
+	{
+		.ir_bits = FPGA_IDCODE_BITS, .idcode = FPGA_IDCODE_INST, .bypass = FPGA_BYPASS_INST,
+		.jprogram = FPGA_JPROGRAM_INST, .cfg_in = FPGA_CFG_IN_INST, .cfg_out = FPGA_CFG_OUT_INST,
+		.jstart = FPGA_JSTART_INST, .user1 = FPGA_USER1_INST, .user2 = FPGA_USER2_INST,
+		.sample = FPGA_SAMPLE_INST, .extest = FPGA_EXTEST_INST
+	},
+	.config = { .init_poll = FPGA_CFG_IN_INST, .flush_bits = FPGA_FLUSH_BITS }
+};
+
+//The last IDCODE read by fpga_identify.
+uint32_t fpga_idcode = 0;
+
+/*
+ * fpga_wait_for_status
+ *
+ * Clocks the FPGA in Run-Test/Idle until a status flag is set. The status is
+ * polled by re-shifting the current instruction, which leaves it loaded.
+ *
+ * instruction:		The instruction currently loaded.
+ * flag:			The FPGA_STATUS flag to wait for.
+ * minimum:			The number of clocks to wait before the first poll.
+ * interval:		The number of clocks between polls.
+ * timeout:			The maximum number of clocks to wait.
+ * clocks:			Receives the number of clocks waited.
+ *
+ * Returns: True iff the flag was set before the timeout.
+ */
+static bool fpga_wait_for_status(char instruction, char flag, uint16_t minimum,
+                                 uint16_t interval, uint16_t timeout, uint16_t* clocks)
+{
+	//the device can't be ready sooner than its minimum time, so don't poll it
+	run_test(minimum);
+	*clocks = minimum;
+
+	while(!(jtag_shift_instruction(instruction, fpga_device.inst.ir_bits, true, true) & flag))
+	{
+		if(*clocks >= timeout)
+			return false;
+
+		run_test(interval);
+		*clocks += interval;
+	}
+
+	return true;
+}
+
 /*
  * fpga_reset
  *
@@ -14,6 +75,10 @@ void fpga_reset()
 {
 	//Reset the device via JTAG.
 	tms_reset();
+
+	//which unloads any USER instruction
+	user_selected = 0;
+	user_scan_open = false;
 }
 
 
@@ -28,6 +93,9 @@ void fpga_set_power(char on)
 {
 	FPGA_POWER_DDR |= 1 << FPGA_POWER_PIN;
 
+	//the FPGA's instruction is lost with its power
+	jtag_invalidate_instruction();
+
 	if(on)
 		FPGA_POWER_PORT |= 1 << FPGA_POWER_PIN;
 	else
@@ -65,48 +133,96 @@ long fpga_get_idcode()
 	return data;
 }
 
+/**
+ * fpga_identify
+ *
+ * Reads the FPGA's IDCODE, and looks it up in the device table; the device's
+ * instruction set and timing are used from then on.
+ *
+ * Returns: True iff the device is known. Otherwise, the Spartan-3E instruction
+ * 			set is assumed, with worst-case timing.
+ */
+bool fpga_identify()
+{
+	fpga_idcode = fpga_get_idcode();
+	return device_lookup(fpga_idcode, &fpga_device);
+}
+
+/**
+ * fpga_get_status()
+ *
+ * Reads the FPGA's status from the instruction capture, leaving the FPGA in BYPASS.
+ *
+ * Returns: The FPGA's status; a combination of FPGA_STATUS flags.
+ */
+char fpga_get_status()
+{
+	char status = jtag_shift_instruction(fpga_device.inst.bypass, fpga_device.inst.ir_bits, true, true);
+
+	//the USER register (if any) is no longer selected
+	user_selected = 0;
+	user_scan_open = false;
+
+	return status & (FPGA_STATUS_DONE | FPGA_STATUS_INIT | FPGA_STATUS_ISC_ENABLED | FPGA_STATUS_ISC_DONE);
+}
+
 /**
  * fpga_init_config
  *
- * Reset the FPGA and initializes configuration.
+ * Reset the FPGA and initializes configuration. The FPGA is identified first,
+ * so the configuration sequence is timed for the device found.
  *
  * jtag_config:		If false, configuration progresses as set by the FPGA's mode flags.
  * 					On the basys2 board, this initializes PROM configuration.
  *
+ * Returns: False if the FPGA's configuration memory didn't clear in time.
  */
-void fpga_init_config(bool jtag_config)
+bool fpga_init_config(bool jtag_config)
 {
-	//reset the FPGA
-	fpga_reset();
+	const fpga_instruction_set* inst = &fpga_device.inst;
+
+	//identify (and reset) the FPGA
+	fpga_identify();
+
+	fpga_timing.init_clocks = 0;
+	fpga_timing.startup_clocks = 0;
 
 	//initialize configuration- this simulates pulsing the PROG_B pin
-	jtag_shift_instruction(FPGA_JPROGRAM_INST, FPGA_JPROGRAM_BITS, true, true);
+	//(JPROGRAM takes effect on Update-IR, so it's always shifted)
+	jtag_shift_instruction(inst->jprogram, inst->ir_bits, true, true);
 
 	//if the user wants to configure the device via JTAG, send the
 	//appropriate instruction
 	if(jtag_config)
 	{
-		//send the CFG_IN instruction
-		jtag_shift_instruction(FPGA_CFG_IN_INST, FPGA_CFG_IN_BITS, true, true);
+		const fpga_config_sequence* config = &fpga_device.config;
+		uint8_t flush = config->flush_bits;
 
-		//wait 14,000 clock cycles
-		run_test(14000);
+		//wait for the configuration memory to clear (INIT_B high), polling with
+		//the family's instruction
+		jtag_load_instruction(config->init_poll, inst->ir_bits);
 
-		//send the CFG_IN instruction
-		jtag_shift_instruction(FPGA_CFG_IN_INST, FPGA_CFG_IN_BITS, true, true);
+		if(!fpga_wait_for_status(config->init_poll, FPGA_STATUS_INIT, fpga_device.part.init_clocks,
+		                         FPGA_INIT_POLL_CLOCKS, FPGA_INIT_TIMEOUT, &fpga_timing.init_clocks))
+			return false;
 
-		//send 95 zeroes (flush register?)
+		//send the CFG_IN instruction; skipped where the polls left it loaded
+		jtag_load_instruction(inst->cfg_in, inst->ir_bits);
 
-		//88 zeroes
-		for(int i=0; i < 11; ++i)
-			jtag_shift_data(0x00, 8, i==0, false);
+		//send the zeroes the family wants ahead of the bitstream
+		while(flush)
+		{
+			uint8_t bits = (flush > 8) ? 8 : flush;
 
-		//and 7 zeroes
-		jtag_shift_data(0x00, 7, false, true);
+			jtag_shift_data(0x00, bits, flush == config->flush_bits, flush == bits);
+			flush -= bits;
+		}
 
-		//send the CFG_IN instruction
-		jtag_shift_instruction(FPGA_CFG_IN_INST, FPGA_CFG_IN_BITS, true, true);
+		//and ensure CFG_IN is still loaded, for the bitstream
+		jtag_load_instruction(inst->cfg_in, inst->ir_bits);
 	}
+
+	return true;
 }
 
 /**
@@ -120,26 +236,292 @@ void fpga_send_config(char c, bool first, bool last)
 	jtag_shift_data(c, 8, first, last);
 }
 
+/**
+ * fpga_send_config_block
+ *
+ * Sends a block of the configuration bitstream; faster than sending it a byte
+ * at a time. Should be preceded by fpga_init_config.
+ *
+ * first:	True iff the block starts the bitstream.
+ * last:	True iff the block ends the bitstream.
+ */
+void fpga_send_config_block(const uint8_t* data, uint16_t length, bool first, bool last)
+{
+	jtag_shift_block(data, length, first, last);
+}
+
+/**
+ * fpga_send_config_stream
+ *
+ * Sends part of the configuration bitstream, fetching each byte from a source
+ * as it's needed (see jtag_shift_stream). Should be preceded by fpga_init_config.
+ *
+ * first:	True iff the data starts the bitstream.
+ * last:	True iff the data ends the bitstream.
+ */
+void fpga_send_config_stream(jtag_byte_source source, uint32_t length, bool first, bool last)
+{
+	jtag_shift_stream(source, length, first, last);
+}
+
+/**
+ * fpga_send_config_lanes
+ *
+ * Sends a single byte of a separate configuration bitstream to each JTAG lane.
+ * Should be preceded by fpga_init_config, and at least one fpga_send_config.
+ *
+ * data:	One byte for each lane (JTAG_LANES bytes).
+ * last:	True iff this is the last byte of the bitstreams.
+ */
+void fpga_send_config_lanes(const uint8_t* data, bool last)
+{
+	uint8_t received[JTAG_LANES];
+
+	jtag_shift_lanes(data, received, 8, false, last);
+}
+
 /**
  * fpga_finish_config
  *
  * Sends the instructions needed to complete configuration.
  * If successful, the FPGA should now be functional.
+ *
+ * Returns: True iff the FPGA raised DONE.
  */
-void fpga_finish_config()
+bool fpga_finish_config()
 {
-	//send the JSTART command
-	jtag_shift_instruction(FPGA_JSTART_INST, FPGA_JSTART_BITS, true, true);
+	const fpga_instruction_set* inst = &fpga_device.inst;
+	bool started;
+
+	//send the JSTART command (always shifted, as it takes effect on Update-IR)
+	jtag_shift_instruction(inst->jstart, inst->ir_bits, true, true);
 
 	//send 16 zeroes
 	for(int i = 0; i < 4; ++i)
 		jtag_shift_data(0x00, 8, i==0, i==3);
 
-	//finish configuration in the idle state
-	tap_set_state(TAP_STATE_IDLE);
+	//clock the startup sequence in the idle state until DONE goes high
+	started = fpga_wait_for_status(inst->jstart, FPGA_STATUS_DONE, fpga_device.part.startup_clocks,
+	                               FPGA_STARTUP_POLL_CLOCKS, FPGA_STARTUP_TIMEOUT, &fpga_timing.startup_clocks);
 
-	//startup time
-	run_test(100);
+	//and finish the remaining startup cycles
+	run_test(FPGA_STARTUP_TAIL_CLOCKS);
+
+	return started;
 }
 
 
+/*
+ * fpga_send_packets
+ *
+ * Sends configuration packets to the FPGA's configuration logic, in a single
+ * CFG_IN scan.
+ *
+ * words:	The packets' words, each sent MSB first.
+ */
+static void fpga_send_packets(const uint32_t* words, uint8_t count)
+{
+	jtag_load_instruction(fpga_device.inst.cfg_in, fpga_device.inst.ir_bits);
+
+	for(uint8_t i = 0; i < count; ++i)
+	{
+		uint8_t bytes[4] = { words[i] >> 24, words[i] >> 16, words[i] >> 8, words[i] };
+
+		jtag_shift_block_msb(bytes, sizeof(bytes), i == 0, i == count - 1);
+	}
+}
+
+/**
+ * fpga_readback_start
+ *
+ * Starts reading back the configuration memory of a configured Spartan-3E over
+ * JTAG: the readback commands are sent to CFG_IN, and CFG_OUT is loaded. The
+ * data is then read with fpga_readback_read, and readback ended with
+ * fpga_readback_finish. The FPGA's design keeps running throughout.
+ *
+ * address:	The frame address (FAR) to start at.
+ * words:	The number of 32-bit words to read; the data starts with a pad
+ * 			frame, before the frame at the address.
+ *
+ * Returns: False if the FPGA's readback isn't supported, or too many words
+ * 			were asked for.
+ */
+bool fpga_readback_start(uint32_t address, uint32_t words)
+{
+	const uint32_t packets[] =
+	{
+		BITSTREAM_DUMMY_WORD,
+		BITSTREAM_SYNC_WORD,
+		BITSTREAM_NOOP,
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_WRITE, BITSTREAM_REG_CMD, 1),
+		BITSTREAM_CMD_RCRC,
+		BITSTREAM_NOOP,
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_WRITE, BITSTREAM_REG_FAR, 1),
+		address,
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_WRITE, BITSTREAM_REG_CMD, 1),
+		BITSTREAM_CMD_RCFG,
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_READ, BITSTREAM_REG_FDRO, 0),
+		BITSTREAM_TYPE_2_HEADER(BITSTREAM_OP_READ, words),
+		BITSTREAM_NOOP,
+		BITSTREAM_NOOP
+	};
+
+	if(fpga_device.part.family != FPGA_FAMILY_SPARTAN3E || words > BITSTREAM_TYPE_2_MAX)
+		return false;
+
+	//the USER register (if any) is no longer selected
+	user_selected = 0;
+	user_scan_open = false;
+
+	fpga_send_packets(packets, sizeof(packets) / sizeof(packets[0]));
+	jtag_load_instruction(fpga_device.inst.cfg_out, fpga_device.inst.ir_bits);
+
+	return true;
+}
+
+/**
+ * fpga_capture
+ *
+ * Captures the state of every flip-flop of a configured Spartan-3E into its
+ * configuration memory (the GCAPTURE command), where it can be read back with
+ * fpga_readback_start; the design keeps running.
+ *
+ * Returns: False if the FPGA's capture isn't supported.
+ */
+bool fpga_capture(void)
+{
+	const uint32_t packets[] =
+	{
+		BITSTREAM_DUMMY_WORD,
+		BITSTREAM_SYNC_WORD,
+		BITSTREAM_NOOP,
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_WRITE, BITSTREAM_REG_CMD, 1),
+		BITSTREAM_CMD_GCAPTURE,
+		BITSTREAM_NOOP,
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_WRITE, BITSTREAM_REG_CMD, 1),
+		BITSTREAM_CMD_DESYNC,
+		BITSTREAM_NOOP,
+		BITSTREAM_NOOP
+	};
+
+	if(fpga_device.part.family != FPGA_FAMILY_SPARTAN3E)
+		return false;
+
+	user_selected = 0;
+	user_scan_open = false;
+
+	fpga_send_packets(packets, sizeof(packets) / sizeof(packets[0]));
+	return true;
+}
+
+/**
+ * fpga_readback_read
+ *
+ * Reads the next part of the readback data (see jtag_read_stream_msb).
+ *
+ * first:	True iff the data starts the readback.
+ * last:	True iff the data ends the readback.
+ */
+void fpga_readback_read(jtag_byte_sink sink, uint32_t length, bool first, bool last)
+{
+	jtag_read_stream_msb(sink, length, first, last);
+}
+
+/**
+ * fpga_readback_finish
+ *
+ * Ends readback, returning the configuration logic to its idle state.
+ */
+void fpga_readback_finish(void)
+{
+	const uint32_t packets[] =
+	{
+		BITSTREAM_TYPE_1_HEADER(BITSTREAM_OP_WRITE, BITSTREAM_REG_CMD, 1),
+		BITSTREAM_CMD_DESYNC,
+		BITSTREAM_NOOP,
+		BITSTREAM_NOOP
+	};
+
+	fpga_send_packets(packets, sizeof(packets) / sizeof(packets[0]));
+}
+
+
+/**
+ * fpga_user_select
+ *
+ * Loads the USER1 or USER2 instruction, connecting the user data register
+ * of a BSCAN-based design between TDI and TDO. The instruction remains
+ * loaded across any number of following DR scans (see fpga_user_shift).
+ *
+ * user:	The USER register to select; FPGA_USER1 or FPGA_USER2.
+ */
+void fpga_user_select(char user)
+{
+	char instruction = (user == FPGA_USER2) ? fpga_device.inst.user2 : fpga_device.inst.user1;
+
+	jtag_load_instruction(instruction, fpga_device.inst.ir_bits);
+
+	user_selected = (user == FPGA_USER2) ? FPGA_USER2 : FPGA_USER1;
+	user_scan_open = false;
+}
+
+/**
+ * fpga_user_shift
+ *
+ * Exchanges a single byte with the selected USER data register, LSB first.
+ * Should be preceded by fpga_user_select.
+ *
+ * Each scan passes through Capture-DR when started and Update-DR when the next
+ * scan starts, which a BSCAN design can use to frame its transfers. Note that
+ * the design sees a single zero (the chain's data header) before the first bit.
+ *
+ * c:		The byte to send.
+ * first:	If true, starts a new DR scan.
+ * last:	If true, ends the current DR scan after this byte.
+ *
+ * Returns: The byte shifted out of the USER register.
+ */
+char fpga_user_shift(char c, bool first, bool last)
+{
+	if(first)
+		user_scan_open = true;
+
+	if(last)
+		user_scan_open = false;
+
+	return jtag_shift_data(c, 8, first, last);
+}
+
+/**
+ * fpga_mailbox_poll
+ *
+ * Checks the console mailbox in the USER2 register for a waiting character,
+ * and acknowledges it if one is present. Any USER register selected for host
+ * transfers is reselected afterwards.
+ *
+ * Returns: The waiting character; or -1 if there was none, or if a USER
+ * 			transfer is in progress (in which case the chain is untouched).
+ */
+int fpga_mailbox_poll(void)
+{
+	char status, c;
+
+	//don't interrupt a USER transfer in progress
+	if(user_scan_open)
+		return -1;
+
+	jtag_load_instruction(fpga_device.inst.user2, fpga_device.inst.ir_bits);
+
+	//read the mailbox status, then the character, acknowledging it if valid
+	status = jtag_shift_data(0x00, 8, true, false);
+	c = jtag_shift_data((status & FPGA_MAILBOX_VALID) ? FPGA_MAILBOX_ACK : 0x00, 8, false, true);
+
+	//pass through Update-DR, so the design sees the acknowledgement right away
+	tap_set_state(TAP_STATE_IDLE);
+
+	//restore the register selected for host transfers
+	if(user_selected == FPGA_USER1)
+		fpga_user_select(FPGA_USER1);
+
+	return (status & FPGA_MAILBOX_VALID) ? (unsigned char)c : -1;
+}
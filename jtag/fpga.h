@@ -6,12 +6,17 @@
 
 //JTAG functions
 #include "core.h"
+#include "devices.h"
 
 #define FPGA_POWER_PORT 	PORTC
 #define FPGA_POWER_DDR 	DDRC
 #define FPGA_POWER_PIN 	2
 
 //FPGA JTAG INSTRUCTIONS
+//
+//These describe the Spartan-3E, and are used until the FPGA has been
+//identified; afterwards, the instruction set of the device found in the
+//device table (fpga_device.inst) is used.
 
 //Request IDCode
 #define FPGA_IDCODE_BITS 6
@@ -25,13 +30,94 @@
 #define FPGA_CFG_IN_BITS 6
 #define FPGA_CFG_IN_INST 0x05
 
+//Read back configuration via JTAG
+#define FPGA_CFG_OUT_BITS 6
+#define FPGA_CFG_OUT_INST 0x04
+
 //Start FPGA after configuration
 #define FPGA_JSTART_BITS 6
 #define FPGA_JSTART_INST 0x0C
 
+//Bypass the FPGA
+#define FPGA_BYPASS_BITS 6
+#define FPGA_BYPASS_INST 0x3F
+
+//Zeroes shifted into CFG_IN ahead of the bitstream (flush register?)
+#define FPGA_FLUSH_BITS 95
+
+//FPGA status, as captured in the instruction register on each IR scan.
+#define FPGA_STATUS_DONE        0x20
+#define FPGA_STATUS_INIT        0x10
+#define FPGA_STATUS_ISC_ENABLED 0x08
+#define FPGA_STATUS_ISC_DONE    0x04
+
+//Configuration waits, in TCK cycles.
+//
+//Rather than waiting a worst-case time, configuration polls the FPGA's status
+//(by re-shifting the current instruction) every few clocks, up to a timeout.
+//The minimum waits before the first poll come from the device table.
+#define FPGA_INIT_POLL_CLOCKS     256	/* between polls for INIT_B (memory clear done) */
+#define FPGA_INIT_TIMEOUT         60000
+#define FPGA_STARTUP_POLL_CLOCKS  8	/* between polls for DONE, after JSTART */
+#define FPGA_STARTUP_TIMEOUT      2048
+#define FPGA_STARTUP_TAIL_CLOCKS  16	/* to finish the startup sequence once DONE is high */
+
+//Sample (or preload) the boundary-scan register
+#define FPGA_SAMPLE_BITS 6
+#define FPGA_SAMPLE_INST 0x01
+
+//Drive the pins from the boundary-scan register
+#define FPGA_EXTEST_BITS 6
+#define FPGA_EXTEST_INST 0x0F
+
+//User-defined data registers (BSCAN_SPARTAN3 USER1/USER2)
+#define FPGA_USER_BITS 6
+#define FPGA_USER1_INST 0x02
+#define FPGA_USER2_INST 0x03
+
+//USER register numbers, for fpga_user_select
+#define FPGA_USER1 1
+#define FPGA_USER2 2
+
+//Console mailbox, in the USER2 register of a soft-core design.
+//
+//Each poll is a 16-bit DR scan. The first byte shifted out is the mailbox
+//status; the second is the waiting character. If a character was waiting,
+//the second byte shifted in acknowledges it, and the design should drop it
+//at Update-DR.
+#define FPGA_MAILBOX_VALID 0x01
+#define FPGA_MAILBOX_ACK   0x01
+
+//Wait times of the last configuration, in TCK cycles.
+typedef struct
+{
+	uint16_t init_clocks;		/* waiting for INIT_B after JPROGRAM */
+	uint16_t startup_clocks;	/* waiting for DONE after JSTART */
+} fpga_config_timing;
+
+extern fpga_config_timing fpga_timing;
+
+//The FPGA on the chain, as identified by fpga_identify.
+extern fpga_device_info fpga_device;
+
+//The IDCODE read by the last fpga_identify; or zero if none has been read.
+extern uint32_t fpga_idcode;
+
 void fpga_reset(void);
 long fpga_get_idcode(void);
+bool fpga_identify(void);
+char fpga_get_status(void);
 void fpga_set_power(char x);
-void fpga_init_config(bool jtag_config);
-void fpga_finish_config(void);
+bool fpga_init_config(bool jtag_config);
+bool fpga_finish_config(void);
 void fpga_send_config(char c, bool first, bool last);
+void fpga_send_config_block(const uint8_t* data, uint16_t length, bool first, bool last);
+void fpga_send_config_stream(jtag_byte_source source, uint32_t length, bool first, bool last);
+void fpga_send_config_lanes(const uint8_t* data, bool last);
+bool fpga_capture(void);
+bool fpga_readback_start(uint32_t address, uint32_t words);
+void fpga_readback_read(jtag_byte_sink sink, uint32_t length, bool first, bool last);
+void fpga_readback_finish(void);
+void fpga_user_select(char user);
+char fpga_user_shift(char c, bool first, bool last);
+int fpga_mailbox_poll(void);
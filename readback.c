@@ -0,0 +1,182 @@
+/**
+ * Configuration Readback
+ *
+ * The CRC is updated as each byte of the data arrives, straight from the JTAG
+ * read kernel, so none of the data is buffered.
+ */
+
+#include "readback.h"
+#include "crc32.h"
+#include "jtag/fpga.h"
+
+#include <string.h>
+
+#ifdef FPGA_READBACK
+
+//The verification in progress.
+static struct
+{
+	uint32_t crc;
+	uint32_t skip;			/* bytes still to be left out of the CRC */
+	jtag_byte_source mask;		/* or null, for no mask */
+} readback_check;
+
+//The snapshot being read.
+static struct
+{
+	readback_range ranges[READBACK_RANGES];
+	uint8_t count;
+	uint8_t range;			/* the range being read */
+	uint16_t frame_words;
+	bool started;			/* the range's readback has started */
+	uint32_t remaining;		/* bytes of the range still to be read */
+	uint8_t* out;			/* where the next byte read goes */
+} readback_snapshot;
+
+/*
+ * readback_verify_byte
+ *
+ * Adds a byte of readback data to the CRC. A jtag_byte_sink.
+ */
+static void readback_verify_byte(uint8_t c)
+{
+	if(readback_check.skip)
+	{
+		--readback_check.skip;
+		return;
+	}
+
+	if(readback_check.mask)
+		c &= ~readback_check.mask();
+
+	readback_check.crc = crc32_update(readback_check.crc, c);
+}
+
+/*
+ * readback_discard_byte
+ *
+ * Ignores a byte of readback data (such as the pad frame). A jtag_byte_sink.
+ */
+static void readback_discard_byte(uint8_t c)
+{
+}
+
+/*
+ * readback_snapshot_byte
+ *
+ * Stores a byte of snapshot data. A jtag_byte_sink.
+ */
+static void readback_snapshot_byte(uint8_t c)
+{
+	*readback_snapshot.out++ = c;
+}
+
+/**
+ * readback_verify
+ *
+ * Reads back part of the configuration memory, and computes its CRC.
+ *
+ * address:	The frame address to start reading at.
+ * words:	The number of 32-bit words to read, including the pad frame.
+ * skip:	The number of leading bytes (normally the pad frame) to leave out
+ * 			of the CRC.
+ * mask:	Returns the mask for each byte of the CRC, in order; or null for
+ * 			no mask.
+ * crc:		Receives the CRC-32 of the data.
+ *
+ * Returns: False if the FPGA's readback isn't supported.
+ */
+bool readback_verify(uint32_t address, uint32_t words, uint32_t skip, jtag_byte_source mask, uint32_t* crc)
+{
+	if(!fpga_readback_start(address, words))
+		return false;
+
+	readback_check.crc = CRC32_INITIAL;
+	readback_check.skip = skip;
+	readback_check.mask = mask;
+
+	fpga_readback_read(readback_verify_byte, words * 4, true, true);
+	fpga_readback_finish();
+
+	*crc = ~readback_check.crc;
+	return true;
+}
+
+/**
+ * readback_snapshot_start
+ *
+ * Captures the state of the FPGA's flip-flops, and starts reading back the
+ * frames which hold it; the frames are then read with readback_snapshot_read.
+ * The readback of each range stays open between reads, so nothing else should
+ * use the JTAG chain until the whole snapshot has been read.
+ *
+ * frame_words:	The length of a frame, in 32-bit words.
+ * ranges:		The frames to read back, in order.
+ * count:		The number of ranges; at most READBACK_RANGES.
+ *
+ * Returns: False if the FPGA's readback isn't supported.
+ */
+bool readback_snapshot_start(uint16_t frame_words, const readback_range* ranges, uint8_t count)
+{
+	if(!fpga_capture())
+		return false;
+
+	memcpy(readback_snapshot.ranges, ranges, count * sizeof(readback_range));
+	readback_snapshot.count = count;
+	readback_snapshot.range = 0;
+	readback_snapshot.frame_words = frame_words;
+	readback_snapshot.started = false;
+
+	return true;
+}
+
+/**
+ * readback_snapshot_read
+ *
+ * Reads the next part of the snapshot: each range's frames in turn, with no
+ * gaps between them. A reply_source_t.
+ *
+ * Returns: The number of bytes read; zero once the snapshot is complete.
+ */
+uint8_t readback_snapshot_read(uint8_t* buffer, uint8_t size)
+{
+	uint8_t count = 0;
+
+	readback_snapshot.out = buffer;
+
+	while(count < size && readback_snapshot.range < readback_snapshot.count)
+	{
+		const readback_range* range = &readback_snapshot.ranges[readback_snapshot.range];
+		uint32_t frame_bytes = readback_snapshot.frame_words * 4UL;
+		uint8_t length;
+
+		//each range's data starts with a pad frame, which is read and dropped
+		if(!readback_snapshot.started)
+		{
+			fpga_readback_start(range->address, (range->frames + 1UL) * readback_snapshot.frame_words);
+			fpga_readback_read(readback_discard_byte, frame_bytes, true, false);
+
+			readback_snapshot.remaining = range->frames * frame_bytes;
+			readback_snapshot.started = true;
+		}
+
+		length = (readback_snapshot.remaining < (uint8_t)(size - count)) ? readback_snapshot.remaining : size - count;
+
+		fpga_readback_read(readback_snapshot_byte, length, false, length == readback_snapshot.remaining);
+
+		count += length;
+		readback_snapshot.remaining -= length;
+
+		if(!readback_snapshot.remaining)
+		{
+			fpga_readback_finish();
+
+			readback_snapshot.started = false;
+			++readback_snapshot.range;
+		}
+	}
+
+	return count;
+}
+
+#endif
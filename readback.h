@@ -0,0 +1,50 @@
+#pragma once
+
+/**
+ * Configuration Readback
+ *
+ * Verifies the FPGA's configuration by reading it back over JTAG (see
+ * fpga_readback_start), and computing a CRC-32 (see crc32.h) of the data on
+ * the device; only the CRC goes back to the host, which compares it with the
+ * CRC of the readback data it expects. Verifying takes about as long as the
+ * readback's JTAG shifts, rather than the far longer time taken to send the
+ * data itself over USB.
+ *
+ * Some configuration bits change as the design runs (LUT RAM, shift registers,
+ * block RAM), and are excluded with a mask: a byte for each byte of the data
+ * in the CRC, whose set bits are cleared before the CRC. The mask isn't the .msk
+ * file written by bitgen -m, which has a .bit header and configuration packets
+ * around its frame data; the host extracts the frame data, lined up with the
+ * readback data, and stores just that.
+ *
+ * Snapshots capture the state of every flip-flop (GCAPTURE), then read back
+ * just the frames which hold the flip-flops of interest: a few ranges of
+ * frames, such as the CLB or IOB columns the host picks. The frames are
+ * streamed back-to-back, without their pad frames, so only a few milliseconds'
+ * worth of data is read rather than the whole device.
+ *
+ * Only built into FPGA_READBACK builds (see unilab.h).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jtag/core.h"
+
+//Most frame ranges in a snapshot.
+#define READBACK_RANGES		8
+
+//A range of frames to be read back.
+typedef struct
+{
+	uint32_t address;	/* frame address (FAR) of the first frame */
+	uint16_t frames;	/* number of frames */
+} readback_range;
+
+#ifdef FPGA_READBACK
+
+bool readback_verify(uint32_t address, uint32_t words, uint32_t skip, jtag_byte_source mask, uint32_t* crc);
+bool readback_snapshot_start(uint16_t frame_words, const readback_range* ranges, uint8_t count);
+uint8_t readback_snapshot_read(uint8_t* buffer, uint8_t size);
+
+#endif
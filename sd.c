@@ -0,0 +1,992 @@
+/**
+ * SD Card Bitstream Store
+ *
+ * The card is driven in SPI mode 0, MSB first; at fosc/128 while it's
+ * initialized (within the 400kHz allowed until then), and at fosc/2 afterwards.
+ *
+ * Sectors are never buffered: small reads (the boot sector, FAT entries and
+ * directory entries) take the part of a sector they need and discard the rest,
+ * and files are streamed a byte at a time. While a file is streamed to the JTAG
+ * chain, the SPI data register and the byte being shifted form a double buffer:
+ * sd_read_next starts receiving the following byte before it returns, and the
+ * card's 16-cycle transfer completes long before the byte's JTAG shift does. The
+ * file's clusters are read with multiple-block reads, one per run of consecutive
+ * clusters, so the card's access time is paid once per fragment, not per sector.
+ *
+ * Files can also be overwritten in place, in the same way; but never created or
+ * extended, so the FAT and directory are never written.
+ */
+
+#include "sd.h"
+
+#ifdef SD_CARD
+
+#include "stats.h"
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+//Card commands. Application commands (ACMD) are marked with SD_ACMD, and are
+//sent after CMD55.
+#define SD_CMD_GO_IDLE		0
+#define SD_CMD_SEND_OP_COND	1	/* MMC initialization */
+#define SD_CMD_SEND_IF_COND	8
+#define SD_CMD_STOP		12
+#define SD_CMD_SET_BLOCKLEN	16
+#define SD_CMD_READ_SINGLE	17
+#define SD_CMD_READ_MULTIPLE	18
+#define SD_CMD_WRITE_MULTIPLE	25
+#define SD_CMD_APP		55
+#define SD_CMD_READ_OCR		58
+#define SD_ACMD			0x80
+#define SD_ACMD_SEND_OP_COND	(SD_ACMD | 41)
+
+//R1 response flags.
+#define SD_R1_IDLE		0x01
+#define SD_R1_ILLEGAL		0x04
+
+//Start of a data block; as read, and as written with a multiple-block write.
+#define SD_TOKEN_DATA		0xFE
+#define SD_TOKEN_WRITE		0xFC
+#define SD_TOKEN_STOP		0xFD	/* ends a multiple-block write */
+
+//Data response to a written block (after masking): accepted.
+#define SD_DATA_RESPONSE_MASK	0x1F
+#define SD_DATA_ACCEPTED	0x05
+
+//Argument of CMD8: 2.7-3.6V, and a check pattern.
+#define SD_IF_COND		0x000001AA
+
+//Host capacity support, in the argument of ACMD41; and the card capacity
+//status, in the first byte of the OCR.
+#define SD_OCR_HCS		0x40000000
+#define SD_OCR_CCS		0x40
+
+//Location of the first partition's entry in a partition table.
+#define SD_MBR_PARTITION	0x1BE
+
+//Directory entries.
+#define SD_DIR_ENTRIES		(SD_SECTOR_SIZE / sizeof(sd_dir_entry))
+#define SD_DIR_END		0x00	/* first name byte: this and all later entries are free */
+#define SD_DIR_DELETED		0xE5	/* first name byte: the entry is free */
+#define SD_ATTR_VOLUME		0x08	/* also set for long name entries */
+#define SD_ATTR_DIRECTORY	0x10
+
+//The start of a FAT boot sector, up to the FAT32 fields used.
+typedef struct
+{
+	uint8_t jump[3];
+	char oem[8];
+	uint16_t bytes_per_sector;
+	uint8_t sectors_per_cluster;
+	uint16_t reserved_sectors;
+	uint8_t fats;
+	uint16_t root_entries;		/* FAT16 */
+	uint16_t total_sectors_16;
+	uint8_t media;
+	uint16_t fat_sectors_16;	/* FAT16 */
+	uint16_t sectors_per_track;
+	uint16_t heads;
+	uint32_t hidden_sectors;
+	uint32_t total_sectors_32;
+	uint32_t fat_sectors_32;	/* FAT32 */
+	uint16_t flags;
+	uint16_t version;
+	uint32_t root_cluster;		/* FAT32 */
+} __attribute__((packed)) sd_boot_sector;
+
+//A directory entry.
+typedef struct
+{
+	char name[SD_NAME_LENGTH];
+	uint8_t attributes;
+	uint8_t reserved[8];
+	uint16_t cluster_high;		/* FAT32 */
+	uint8_t modified[4];
+	uint16_t cluster_low;
+	uint32_t size;
+} sd_dir_entry;
+
+//The mounted volume.
+static struct
+{
+	bool mounted;
+	bool block_addressing;		/* high capacity cards are addressed by sector, not byte */
+	bool fat32;
+	uint8_t cluster_shift;		/* log2 of the sectors per cluster */
+	uint32_t fat_start;		/* first sector of the FAT */
+	uint32_t root_start;		/* FAT16: first sector of the root directory */
+	uint16_t root_entries;		/* FAT16: size of the root directory */
+	uint32_t root_cluster;		/* FAT32: first cluster of the root directory */
+	uint32_t data_start;		/* first sector of cluster 2 */
+} sd_volume;
+
+//The file being read by sd_read_next, or written by sd_write_block.
+static struct
+{
+	bool error;
+	uint16_t block_remaining;	/* bytes left in the current sector; if reading and nonzero, the next is being received */
+	uint32_t run_sectors;		/* sectors left in the current run of clusters, including the current sector */
+	uint32_t next_cluster;		/* the cluster after the current run; or zero */
+} sd_stream;
+
+//The next directory entry to be listed by sd_list_read.
+static uint16_t sd_list_index;
+
+//The name of the boot file.
+static char EEMEM sd_boot_name[SD_NAME_LENGTH];
+
+/*
+ * sd_transfer
+ *
+ * Exchanges a byte with the card.
+ */
+static uint8_t sd_transfer(uint8_t c)
+{
+	SPDR = c;
+	while(!(SPSR & (1 << SPIF)));
+
+	return SPDR;
+}
+
+static inline uint8_t sd_receive(void)
+{
+	return sd_transfer(0xFF);
+}
+
+static void sd_skip(uint16_t length)
+{
+	while(length--)
+		sd_receive();
+}
+
+static void sd_receive_block(void* buffer, uint16_t length)
+{
+	uint8_t* data = buffer;
+
+	while(length--)
+		*data++ = sd_receive();
+}
+
+static void sd_select(void)
+{
+	SD_CS_PORT &= ~(1 << SD_CS_PIN);
+}
+
+static void sd_deselect(void)
+{
+	SD_CS_PORT |= 1 << SD_CS_PIN;
+
+	//the card only releases its data out line on the next clock
+	sd_receive();
+}
+
+/*
+ * sd_wait
+ *
+ * Receives bytes until one differs from the given value, or a timeout.
+ *
+ * Returns: The byte received; or the given value, on timeout.
+ */
+static uint8_t sd_wait(uint8_t value, uint32_t timeout)
+{
+	uint32_t start = stats_now();
+	uint8_t c;
+
+	while((c = sd_receive()) == value)
+		if(stats_now() - start > timeout)
+			break;
+
+	return c;
+}
+
+/*
+ * sd_command
+ *
+ * Sends a command to the card, selecting it first, and waits for its response.
+ *
+ * Returns: The R1 response; the rest of the response, if any, follows.
+ */
+static uint8_t sd_command(uint8_t command, uint32_t argument)
+{
+	uint8_t response;
+
+	if(command & SD_ACMD)
+	{
+		response = sd_command(SD_CMD_APP, 0);
+
+		if(response & ~SD_R1_IDLE)
+			return response;
+
+		command &= ~SD_ACMD;
+	}
+
+	//CMD12 interrupts a read, so is sent without waiting for the card
+	if(command != SD_CMD_STOP)
+	{
+		sd_deselect();
+		sd_select();
+
+		//wait for the card to finish any previous operation
+		if(sd_wait(0x00, SD_READ_TIMEOUT) != 0xFF)
+			return 0xFF;
+	}
+
+	sd_transfer(0x40 | command);
+	sd_transfer(argument >> 24);
+	sd_transfer(argument >> 16);
+	sd_transfer(argument >> 8);
+	sd_transfer(argument);
+
+	//the CRC is only checked until the card is in SPI mode, for CMD0 and CMD8
+	sd_transfer((command == SD_CMD_GO_IDLE) ? 0x95 : (command == SD_CMD_SEND_IF_COND) ? 0x87 : 0x01);
+
+	//CMD12 is followed by a stuff byte
+	if(command == SD_CMD_STOP)
+		sd_receive();
+
+	//the response arrives within eight bytes
+	for(uint8_t i = 0; i < 8; ++i)
+	{
+		response = sd_receive();
+
+		if(!(response & 0x80))
+			break;
+	}
+
+	return response;
+}
+
+/*
+ * sd_initialize
+ *
+ * Initializes the SPI port, and the card.
+ *
+ * Returns: True iff a card was found and initialized.
+ */
+static bool sd_initialize(void)
+{
+	uint8_t command = SD_ACMD_SEND_OP_COND;
+	uint8_t response[4];
+	uint32_t start;
+	bool version2;
+
+	//chip select, SCK and MOSI are outputs; as is SS, which would otherwise
+	//switch the SPI to slave mode when low
+	SD_CS_PORT |= 1 << SD_CS_PIN;
+	SD_CS_DDR |= 1 << SD_CS_PIN;
+	DDRB |= (1 << PB0) | (1 << PB1) | (1 << PB2);
+	DDRB &= ~(1 << PB3);
+
+	//master, mode 0, fosc/128
+	SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
+	SPSR = 0;
+
+	//at least 74 clocks with the card deselected, as it powers up
+	sd_skip(10);
+
+	//enter SPI mode
+	if(sd_command(SD_CMD_GO_IDLE, 0) != SD_R1_IDLE)
+		goto fail;
+
+	//version 2 cards (which may be high capacity) accept CMD8, and echo its check pattern
+	version2 = (sd_command(SD_CMD_SEND_IF_COND, SD_IF_COND) == SD_R1_IDLE);
+
+	if(version2)
+	{
+		sd_receive_block(response, sizeof(response));
+
+		if(response[2] != (uint8_t)(SD_IF_COND >> 8) || response[3] != (uint8_t)SD_IF_COND)
+			goto fail;
+	}
+
+	//start initialization, and wait for it to finish; MMC cards don't have ACMD41, and use CMD1
+	start = stats_now();
+
+	while((response[0] = sd_command(command, version2 ? SD_OCR_HCS : 0)) != 0)
+	{
+		if(response[0] & SD_R1_ILLEGAL)
+			command = SD_CMD_SEND_OP_COND;
+
+		if(stats_now() - start > SD_INIT_TIMEOUT)
+			goto fail;
+	}
+
+	//find whether the card is addressed by sector
+	sd_volume.block_addressing = false;
+
+	if(version2)
+	{
+		if(sd_command(SD_CMD_READ_OCR, 0) != 0)
+			goto fail;
+
+		sd_receive_block(response, sizeof(response));
+		sd_volume.block_addressing = response[0] & SD_OCR_CCS;
+	}
+
+	//if not, its block length may need to be set
+	if(!sd_volume.block_addressing && sd_command(SD_CMD_SET_BLOCKLEN, SD_SECTOR_SIZE) != 0)
+		goto fail;
+
+	sd_deselect();
+
+	//and switch to full speed: fosc/2
+	SPCR = (1 << SPE) | (1 << MSTR);
+	SPSR = 1 << SPI2X;
+
+	return true;
+
+fail:
+	sd_deselect();
+	return false;
+}
+
+static uint32_t sd_address(uint32_t sector)
+{
+	return sd_volume.block_addressing ? sector : sector * SD_SECTOR_SIZE;
+}
+
+/*
+ * sd_block_open
+ *
+ * Starts reading a single sector; the card is left selected.
+ *
+ * Returns: True iff the sector's data has started. If not, the card is
+ * 			deselected, and will be reinitialized by the next sd_mount.
+ */
+static bool sd_block_open(uint32_t sector)
+{
+	if(sd_command(SD_CMD_READ_SINGLE, sd_address(sector)) == 0 && sd_wait(0xFF, SD_READ_TIMEOUT) == SD_TOKEN_DATA)
+		return true;
+
+	sd_deselect();
+	sd_volume.mounted = false;
+
+	return false;
+}
+
+/*
+ * sd_block_close
+ *
+ * Discards the rest of a sector started by sd_block_open, and its CRC.
+ */
+static void sd_block_close(uint16_t remaining)
+{
+	sd_skip(remaining + 2);
+	sd_deselect();
+}
+
+/*
+ * sd_read_bytes
+ *
+ * Reads part of a sector.
+ */
+static bool sd_read_bytes(uint32_t sector, uint16_t offset, void* buffer, uint16_t length)
+{
+	if(!sd_block_open(sector))
+		return false;
+
+	sd_skip(offset);
+	sd_receive_block(buffer, length);
+	sd_block_close(SD_SECTOR_SIZE - offset - length);
+
+	return true;
+}
+
+static uint32_t sd_cluster_sector(uint32_t cluster)
+{
+	return sd_volume.data_start + ((cluster - 2) << sd_volume.cluster_shift);
+}
+
+/*
+ * sd_cluster_run
+ *
+ * Follows a cluster chain from the given cluster for as long as its clusters
+ * are consecutive (up to the end of the FAT sector holding the first).
+ *
+ * next:	Receives the cluster following the run; or zero at the end of
+ * 			the chain.
+ *
+ * Returns: The number of clusters in the run; or zero if the FAT couldn't be read.
+ */
+static uint32_t sd_cluster_run(uint32_t cluster, uint32_t* next)
+{
+	uint8_t entry_size = sd_volume.fat32 ? 4 : 2;
+	uint16_t offset = (cluster * entry_size) % SD_SECTOR_SIZE;
+	uint32_t count = 0;
+	uint32_t entry;
+
+	if(!sd_block_open(sd_volume.fat_start + (cluster * entry_size) / SD_SECTOR_SIZE))
+		return 0;
+
+	sd_skip(offset);
+
+	//the entries of consecutive clusters are consecutive, so a run can be followed in a single read
+	do
+	{
+		entry = 0;
+		sd_receive_block(&entry, entry_size);
+
+		offset += entry_size;
+		++count;
+	}
+	while(entry == cluster + count && offset < SD_SECTOR_SIZE);
+
+	sd_block_close(SD_SECTOR_SIZE - offset);
+
+	if(sd_volume.fat32)
+		entry &= 0x0FFFFFFF;
+
+	//the end of the chain (or a free or bad cluster, which shouldn't be in a chain)
+	if(entry < 2 || entry >= (sd_volume.fat32 ? 0x0FFFFFF7 : 0xFFF7))
+		entry = 0;
+
+	*next = entry;
+	return count;
+}
+
+/**
+ * sd_mount
+ *
+ * Initializes the card and reads its volume's layout, if that hasn't been done
+ * since the card was last found to be missing.
+ *
+ * Returns: True iff a FAT16 or FAT32 volume was found.
+ */
+bool sd_mount(void)
+{
+	sd_boot_sector boot;
+	uint32_t volume = 0;
+	uint32_t fat_sectors, total_sectors, clusters;
+
+	if(sd_volume.mounted)
+		return true;
+
+	if(!sd_initialize())
+		return false;
+
+	//the card either holds a single volume, or starts with a partition table
+	if(!sd_read_bytes(0, 0, &boot, sizeof(boot)))
+		return false;
+
+	if(boot.jump[0] != 0xEB && boot.jump[0] != 0xE9)
+	{
+		uint32_t partition[4];
+
+		//use the first partition
+		if(!sd_read_bytes(0, SD_MBR_PARTITION, partition, sizeof(partition)))
+			return false;
+
+		volume = partition[2];
+
+		if(!sd_read_bytes(volume, 0, &boot, sizeof(boot)))
+			return false;
+	}
+
+	if(boot.bytes_per_sector != SD_SECTOR_SIZE || !boot.fats || !boot.sectors_per_cluster ||
+	   (boot.sectors_per_cluster & (boot.sectors_per_cluster - 1)))
+		return false;
+
+	sd_volume.cluster_shift = 0;
+
+	while((1 << sd_volume.cluster_shift) < boot.sectors_per_cluster)
+		++sd_volume.cluster_shift;
+
+	fat_sectors = boot.fat_sectors_16 ? boot.fat_sectors_16 : boot.fat_sectors_32;
+	total_sectors = boot.total_sectors_16 ? boot.total_sectors_16 : boot.total_sectors_32;
+
+	sd_volume.fat_start = volume + boot.reserved_sectors;
+	sd_volume.root_start = sd_volume.fat_start + boot.fats * fat_sectors;
+	sd_volume.root_entries = boot.root_entries;
+	sd_volume.root_cluster = boot.root_cluster;
+	sd_volume.data_start = sd_volume.root_start + (boot.root_entries * sizeof(sd_dir_entry) + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+
+	//the FAT type is determined by the number of clusters; FAT12 isn't supported
+	clusters = (total_sectors - (sd_volume.data_start - volume)) >> sd_volume.cluster_shift;
+
+	if(clusters < 4085)
+		return false;
+
+	sd_volume.fat32 = (clusters >= 65525);
+	sd_volume.mounted = true;
+
+	return true;
+}
+
+/**
+ * sd_unmount
+ *
+ * Forgets the card, so the next operation reinitializes it; for instance,
+ * after it's been replaced.
+ */
+void sd_unmount(void)
+{
+	sd_volume.mounted = false;
+}
+
+/*
+ * sd_dir_sector
+ *
+ * Returns: The sector holding an entry of the root directory; or zero if it's
+ * 			past the end of the directory.
+ */
+static uint32_t sd_dir_sector(uint16_t index)
+{
+	uint32_t sector = index / SD_DIR_ENTRIES;
+	uint32_t cluster = sd_volume.root_cluster;
+
+	//the FAT16 root directory has a fixed size and place
+	if(!sd_volume.fat32)
+		return (index < sd_volume.root_entries) ? sd_volume.root_start + sector : 0;
+
+	//the FAT32 root directory is a cluster chain
+	while(cluster)
+	{
+		uint32_t next;
+		uint32_t run = sd_cluster_run(cluster, &next);
+
+		if(!run)
+			return 0;
+
+		if((sector >> sd_volume.cluster_shift) < run)
+			return sd_cluster_sector(cluster) + sector;
+
+		sector -= run << sd_volume.cluster_shift;
+		cluster = next;
+	}
+
+	return 0;
+}
+
+/*
+ * sd_dir_next
+ *
+ * Finds the next file in the root directory.
+ *
+ * index:	The entry to start at; receives the entry after the file found.
+ * file:	Receives the file found.
+ *
+ * Returns: True iff a file was found.
+ */
+static bool sd_dir_next(uint16_t* index, sd_file* file)
+{
+	sd_dir_entry entry;
+
+	for(;;)
+	{
+		uint32_t sector = sd_dir_sector(*index);
+		uint16_t offset = (*index % SD_DIR_ENTRIES) * sizeof(sd_dir_entry);
+		bool found = false;
+
+		if(!sector || !sd_block_open(sector))
+			return false;
+
+		sd_skip(offset);
+
+		//read the rest of the sector's entries, up to the first file
+		while(offset < SD_SECTOR_SIZE && !found)
+		{
+			sd_receive_block(&entry, sizeof(entry));
+			offset += sizeof(entry);
+
+			if((uint8_t)entry.name[0] == SD_DIR_END)
+				break;
+
+			++*index;
+
+			found = (uint8_t)entry.name[0] != SD_DIR_DELETED && !(entry.attributes & (SD_ATTR_VOLUME | SD_ATTR_DIRECTORY));
+		}
+
+		sd_block_close(SD_SECTOR_SIZE - offset);
+
+		if((uint8_t)entry.name[0] == SD_DIR_END)
+			return false;
+
+		if(found)
+		{
+			memcpy(file->name, entry.name, SD_NAME_LENGTH);
+			file->reserved = 0;
+			file->size = entry.size;
+			file->cluster = ((uint32_t)(sd_volume.fat32 ? entry.cluster_high : 0) << 16) | entry.cluster_low;
+
+			return true;
+		}
+	}
+}
+
+/**
+ * sd_find
+ *
+ * Finds a file in the root directory.
+ *
+ * name:	The file's name (SD_NAME_LENGTH characters, as stored).
+ * file:	Receives the file.
+ *
+ * Returns: True iff the file was found.
+ */
+bool sd_find(const char* name, sd_file* file)
+{
+	uint16_t index = 0;
+
+	if(!sd_mount())
+		return false;
+
+	while(sd_dir_next(&index, file))
+		if(!memcmp(file->name, name, SD_NAME_LENGTH))
+			return true;
+
+	return false;
+}
+
+/**
+ * sd_list_start
+ *
+ * Starts listing the root directory's files; see sd_list_read.
+ */
+void sd_list_start(void)
+{
+	sd_list_index = 0;
+}
+
+/**
+ * sd_list_read
+ *
+ * Reply stream source for a directory listing; fills the buffer with the next
+ * files' sd_list_entry records.
+ *
+ * Returns: The number of bytes produced; zero once every file has been listed.
+ */
+uint8_t sd_list_read(uint8_t* buffer, uint8_t size)
+{
+	uint8_t length = 0;
+	sd_file file;
+
+	if(!sd_mount())
+		return 0;
+
+	while(length + sizeof(sd_list_entry) <= size && sd_dir_next(&sd_list_index, &file))
+	{
+		sd_list_entry* entry = (sd_list_entry*)&buffer[length];
+
+		memcpy(entry->name, file.name, SD_NAME_LENGTH);
+		entry->reserved = 0;
+		entry->size = file.size;
+
+		length += sizeof(sd_list_entry);
+	}
+
+	return length;
+}
+
+/*
+ * sd_run_start
+ *
+ * Starts a multiple-block read of the run of consecutive clusters starting at
+ * the given cluster, and waits for its first sector.
+ */
+static bool sd_run_start(uint32_t cluster)
+{
+	uint32_t run = sd_cluster_run(cluster, &sd_stream.next_cluster);
+
+	if(!run || sd_command(SD_CMD_READ_MULTIPLE, sd_address(sd_cluster_sector(cluster))) != 0)
+		return false;
+
+	sd_stream.run_sectors = run << sd_volume.cluster_shift;
+
+	return sd_wait(0xFF, SD_READ_TIMEOUT) == SD_TOKEN_DATA;
+}
+
+/*
+ * sd_next_block
+ *
+ * Moves the file being read on to its next sector, starting a new read if
+ * that's in another run of clusters, and starts receiving its first byte.
+ */
+static void sd_next_block(void)
+{
+	//discard the finished sector's CRC
+	sd_skip(2);
+
+	if(--sd_stream.run_sectors)
+	{
+		if(sd_wait(0xFF, SD_READ_TIMEOUT) != SD_TOKEN_DATA)
+			sd_stream.error = true;
+	}
+	else
+	{
+		sd_command(SD_CMD_STOP, 0);
+
+		if(!sd_stream.next_cluster || !sd_run_start(sd_stream.next_cluster))
+			sd_stream.error = true;
+	}
+
+	if(sd_stream.error)
+		return;
+
+	sd_stream.block_remaining = SD_SECTOR_SIZE;
+	SPDR = 0xFF;
+}
+
+/**
+ * sd_read_start
+ *
+ * Starts reading a file, from its beginning; its bytes are then read with
+ * sd_read_next, and the read ended with sd_read_stop. The card remains
+ * selected until then, so nothing else may use the SPI port.
+ *
+ * Returns: True iff the file's data has started.
+ */
+bool sd_read_start(const sd_file* file)
+{
+	sd_stream.block_remaining = 0;
+	sd_stream.error = !sd_volume.mounted || file->cluster < 2 || !sd_run_start(file->cluster);
+
+	if(sd_stream.error)
+		return false;
+
+	//start receiving the first byte
+	sd_stream.block_remaining = SD_SECTOR_SIZE;
+	SPDR = 0xFF;
+
+	return true;
+}
+
+/**
+ * sd_read_next
+ *
+ * Returns the next byte of the file being read, and starts receiving the one
+ * after it, which proceeds while the caller uses this one. A jtag_byte_source.
+ *
+ * Returns: The next byte; or 0xFF if the card couldn't be read, in which case
+ * 			sd_read_stop will fail.
+ */
+uint8_t sd_read_next(void)
+{
+	uint8_t c;
+
+	if(sd_stream.error)
+		return 0xFF;
+
+	if(!sd_stream.block_remaining)
+	{
+		sd_next_block();
+
+		if(sd_stream.error)
+			return 0xFF;
+	}
+
+	//the byte started by the last call has normally long since arrived
+	while(!(SPSR & (1 << SPIF)));
+	c = SPDR;
+
+	if(--sd_stream.block_remaining)
+		SPDR = 0xFF;
+
+	return c;
+}
+
+/**
+ * sd_read_stop
+ *
+ * Ends the read started by sd_read_start, and deselects the card.
+ *
+ * Returns: True iff every byte was read successfully.
+ */
+bool sd_read_stop(void)
+{
+	//finish the transfer in progress, if any
+	if(sd_stream.block_remaining)
+	{
+		while(!(SPSR & (1 << SPIF)));
+		(void)SPDR;
+	}
+
+	sd_stream.block_remaining = 0;
+
+	sd_command(SD_CMD_STOP, 0);
+	sd_deselect();
+
+	if(sd_stream.error)
+		sd_volume.mounted = false;
+
+	return !sd_stream.error;
+}
+
+/*
+ * sd_write_run_start
+ *
+ * Starts a multiple-block write to the run of consecutive clusters starting at
+ * the given cluster.
+ */
+static bool sd_write_run_start(uint32_t cluster)
+{
+	uint32_t run = sd_cluster_run(cluster, &sd_stream.next_cluster);
+
+	if(!run || sd_command(SD_CMD_WRITE_MULTIPLE, sd_address(sd_cluster_sector(cluster))) != 0)
+		return false;
+
+	sd_stream.run_sectors = run << sd_volume.cluster_shift;
+
+	return true;
+}
+
+/*
+ * sd_write_end
+ *
+ * Ends a multiple-block write, and waits for the card to finish writing.
+ */
+static void sd_write_end(void)
+{
+	sd_transfer(SD_TOKEN_STOP);
+	sd_receive();
+
+	if(sd_wait(0x00, SD_WRITE_TIMEOUT) != 0xFF)
+		sd_stream.error = true;
+}
+
+/*
+ * sd_write_block_start
+ *
+ * Starts writing the next sector of the file being written, starting a new
+ * write if that's in another run of clusters.
+ */
+static void sd_write_block_start(void)
+{
+	if(!sd_stream.run_sectors)
+	{
+		sd_write_end();
+
+		if(sd_stream.error || !sd_stream.next_cluster || !sd_write_run_start(sd_stream.next_cluster))
+		{
+			sd_stream.error = true;
+			return;
+		}
+	}
+
+	sd_transfer(SD_TOKEN_WRITE);
+	sd_stream.block_remaining = SD_SECTOR_SIZE;
+}
+
+/*
+ * sd_write_block_end
+ *
+ * Finishes writing a sector, once all of its data has been sent.
+ */
+static void sd_write_block_end(void)
+{
+	//the CRC isn't checked
+	sd_skip(2);
+
+	if((sd_receive() & SD_DATA_RESPONSE_MASK) != SD_DATA_ACCEPTED)
+		sd_stream.error = true;
+
+	//wait while the card is busy writing
+	if(sd_wait(0x00, SD_WRITE_TIMEOUT) != 0xFF)
+		sd_stream.error = true;
+
+	--sd_stream.run_sectors;
+}
+
+/**
+ * sd_write_start
+ *
+ * Starts overwriting a file, from its beginning; the data is then written with
+ * sd_write_block, and the write ended with sd_write_stop. Only the clusters
+ * already allocated to the file can be written; its size isn't changed. The
+ * card remains selected until the write ends.
+ *
+ * Returns: True iff the write has started.
+ */
+bool sd_write_start(const sd_file* file)
+{
+	sd_stream.block_remaining = 0;
+	sd_stream.run_sectors = 0;
+	sd_stream.error = !sd_volume.mounted || file->cluster < 2 || !sd_write_run_start(file->cluster);
+
+	return !sd_stream.error;
+}
+
+/**
+ * sd_write_block
+ *
+ * Writes the next part of the file being written.
+ */
+void sd_write_block(const uint8_t* data, uint16_t length)
+{
+	while(length-- && !sd_stream.error)
+	{
+		if(!sd_stream.block_remaining)
+		{
+			sd_write_block_start();
+
+			if(sd_stream.error)
+				break;
+		}
+
+		sd_transfer(*data++);
+
+		if(!--sd_stream.block_remaining)
+			sd_write_block_end();
+	}
+}
+
+/**
+ * sd_write_stop
+ *
+ * Ends the write started by sd_write_start, padding the last sector written
+ * with zeroes, and deselects the card.
+ *
+ * Returns: True iff everything was written successfully.
+ */
+bool sd_write_stop(void)
+{
+	while(sd_stream.block_remaining && !sd_stream.error)
+	{
+		sd_transfer(0x00);
+
+		if(!--sd_stream.block_remaining)
+			sd_write_block_end();
+	}
+
+	sd_stream.block_remaining = 0;
+
+	sd_write_end();
+	sd_deselect();
+
+	if(sd_stream.error)
+		sd_volume.mounted = false;
+
+	return !sd_stream.error;
+}
+
+/**
+ * sd_get_boot_name / sd_set_boot_name
+ *
+ * Read and change the name of the file the FPGA is configured from at power-up,
+ * which is kept in EEPROM.
+ */
+void sd_get_boot_name(char* name)
+{
+	eeprom_read_block(name, sd_boot_name, SD_NAME_LENGTH);
+}
+
+void sd_set_boot_name(const char* name)
+{
+	eeprom_update_block(name, sd_boot_name, SD_NAME_LENGTH);
+}
+
+/**
+ * sd_name_valid
+ *
+ * Returns: True iff the name could be a file's; erased EEPROM (0xFF) and
+ * 			zeroes, which mean no boot file is set, aren't.
+ */
+bool sd_name_valid(const char* name)
+{
+	uint8_t first = name[0];
+
+	return first != 0x00 && first != 0xFF && first != ' ';
+}
+
+#endif
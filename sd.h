@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * SD Card Bitstream Store
+ *
+ * Reads bitstreams from an SD or MMC card in SPI mode, on the hardware SPI
+ * port. The card holds a FAT16 or FAT32 volume (either the whole card, or its
+ * first partition); bitstreams are configuration files (.bit files, or .bin files
+ * as produced by bitgen -g binary:yes; see jtag/bitstream.h) in its root
+ * directory, and are named by their 8.3 names.
+ *
+ * Only as much of FAT is implemented as is needed to find and read those files:
+ * there are no long names or subdirectories, and files can be overwritten, but
+ * not created or resized.
+ * Files are read sector by sector straight to the JTAG chain, without a sector
+ * buffer; see sd_read_next.
+ *
+ * The name of a boot file is kept in EEPROM; at power-up, the FPGA is
+ * configured from it, without a host.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "unilab.h"
+
+#ifdef SD_CARD
+
+#if !defined(SD_CS_PORT) || !defined(SD_CS_DDR) || !defined(SD_CS_PIN)
+	#error Define the chip select pin of the SD card (see unilab.h).
+#endif
+
+//Length of a file name: an 8.3 name as stored in the directory, without the
+//dot, with each part padded with spaces; e.g. "DESIGN  BIN".
+#define SD_NAME_LENGTH		11
+
+//Sector size; the only one supported.
+#define SD_SECTOR_SIZE		512
+
+//Timeouts, in CPU cycles (see stats_now).
+#define SD_INIT_TIMEOUT		(F_CPU)		/* for the card to leave the idle state */
+#define SD_READ_TIMEOUT		(F_CPU / 10)	/* for a data block to start */
+#define SD_WRITE_TIMEOUT	(F_CPU / 4)	/* for a data block to be written */
+
+//A file in the root directory.
+typedef struct
+{
+	char name[SD_NAME_LENGTH];
+	uint8_t reserved;
+	uint32_t size;		/* in bytes */
+	uint32_t cluster;	/* first cluster */
+} sd_file;
+
+//A file in a directory listing, as sent to the host.
+typedef struct
+{
+	char name[SD_NAME_LENGTH];
+	uint8_t reserved;
+	uint32_t size;
+} sd_list_entry;
+
+bool sd_mount(void);
+void sd_unmount(void);
+bool sd_find(const char* name, sd_file* file);
+void sd_list_start(void);
+uint8_t sd_list_read(uint8_t* buffer, uint8_t size);
+
+bool sd_read_start(const sd_file* file);
+uint8_t sd_read_next(void);
+bool sd_read_stop(void);
+
+bool sd_write_start(const sd_file* file);
+void sd_write_block(const uint8_t* data, uint16_t length);
+bool sd_write_stop(void);
+
+void sd_get_boot_name(char* name);
+void sd_set_boot_name(const char* name);
+bool sd_name_valid(const char* name);
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * SPI Flash Programming
+ *
+ * Data read from the flash goes straight from the JTAG read kernel into a
+ * CRC, and data to be programmed straight from its source to the JTAG shift
+ * kernel, so none of it is buffered.
+ */
+
+#include "spiflash.h"
+#include "crc32.h"
+#include "stats.h"
+#include "jtag/fpga.h"
+
+#ifdef SPI_FLASH
+
+//The sector being checked.
+static struct
+{
+	uint32_t crc;
+	uint8_t blank;			/* all of the bytes so far, ANDed; 0xFF if erased */
+} spiflash_check;
+
+/*
+ * spiflash_check_byte
+ *
+ * Adds a byte read from the flash to the check. A jtag_byte_sink.
+ */
+static void spiflash_check_byte(uint8_t c)
+{
+	spiflash_check.crc = crc32_update(spiflash_check.crc, c);
+	spiflash_check.blank &= c;
+}
+
+/*
+ * spiflash_select
+ *
+ * Selects the bridge's register.
+ *
+ * Returns: False if the FPGA isn't configured, so there's no bridge.
+ */
+static bool spiflash_select(void)
+{
+	if(!(fpga_get_status() & FPGA_STATUS_DONE))
+		return false;
+
+	fpga_user_select(FPGA_USER1);
+	return true;
+}
+
+/*
+ * spiflash_send
+ *
+ * Starts a transaction, and sends its command.
+ *
+ * command:	The command, and its address (if any), as sent.
+ * length:	The length of the command, in bytes.
+ * bits:	The length of the whole transaction, in bits.
+ * last:	True iff the transaction ends with the command.
+ */
+static void spiflash_send(const uint8_t* command, uint8_t length, uint32_t bits, bool last)
+{
+	const uint8_t header[] = { bits >> 24, bits >> 16, bits >> 8, bits };
+
+	//the start bit follows the chain's data header
+	jtag_shift_data(0x01, 1, true, false);
+	jtag_shift_block_msb(header, sizeof(header), false, false);
+	jtag_shift_block_msb(command, length, false, last);
+}
+
+/*
+ * spiflash_read
+ *
+ * Runs a transaction which reads data, after sending its command.
+ *
+ * sink:	Receives each byte read.
+ * count:	The number of bytes to read.
+ */
+static void spiflash_read(const uint8_t* command, uint8_t length, jtag_byte_sink sink, uint32_t count)
+{
+	spiflash_send(command, length, 8 * (length + count), false);
+
+	//clock the first data bits while their MISO is still on its way to TDO, so
+	//the data arrives aligned to bytes
+	jtag_shift_data(0xFF, SPIFLASH_LATENCY, false, false);
+	jtag_read_stream_msb(sink, count, false, true);
+}
+
+/*
+ * spiflash_address_command
+ *
+ * Builds a command which takes a (24-bit) address.
+ */
+static void spiflash_address_command(uint8_t* command, uint8_t opcode, uint32_t address)
+{
+	command[0] = opcode;
+	command[1] = address >> 16;
+	command[2] = address >> 8;
+	command[3] = address;
+}
+
+/*
+ * spiflash_write_enable
+ *
+ * Enables the next write or erase.
+ */
+static void spiflash_write_enable(void)
+{
+	const uint8_t command = SPIFLASH_WRITE_ENABLE;
+
+	spiflash_send(&command, 1, 8, true);
+}
+
+/*
+ * spiflash_wait
+ *
+ * Waits for a write or erase to finish, reading the status over and over in a
+ * single transaction.
+ *
+ * timeout:	The longest wait, in CPU cycles.
+ *
+ * Returns: False if the flash is still busy.
+ */
+static bool spiflash_wait(uint32_t timeout)
+{
+	const uint8_t command = SPIFLASH_READ_STATUS;
+	uint32_t start = stats_now();
+	uint16_t polls = 0;
+	uint8_t status;
+
+	spiflash_send(&command, 1, SPIFLASH_MAX_BITS, false);
+	jtag_shift_data(0xFF, SPIFLASH_LATENCY, false, false);
+
+	do
+	{
+		status = jtag_reverse(jtag_shift_data(0xFF, 8, false, false));
+
+		//erases take a while, so let the rest of the system run
+		if(jtag_idle_callback && (++polls & (JTAG_IDLE_INTERVAL / 8 - 1)) == 0)
+			jtag_idle_callback();
+	}
+	while((status & SPIFLASH_STATUS_WIP) && stats_now() - start <= timeout);
+
+	//leaving Shift-DR ends the transaction
+	jtag_shift_data(0xFF, 1, false, true);
+
+	return !(status & SPIFLASH_STATUS_WIP);
+}
+
+/**
+ * spiflash_read_id
+ *
+ * Reads the flash's JEDEC ID: its manufacturer, memory type and capacity.
+ *
+ * id:		Receives the SPIFLASH_ID_LENGTH bytes of the ID.
+ *
+ * Returns: A SPIFLASH_ result.
+ */
+uint8_t spiflash_read_id(uint8_t* id)
+{
+	const uint8_t command = SPIFLASH_READ_ID;
+
+	if(!spiflash_select())
+		return SPIFLASH_NO_BRIDGE;
+
+	spiflash_send(&command, 1, 8 * (1 + SPIFLASH_ID_LENGTH), false);
+	jtag_shift_data(0xFF, SPIFLASH_LATENCY, false, false);
+
+	for(uint8_t i = 0; i < SPIFLASH_ID_LENGTH; ++i)
+		id[i] = jtag_reverse(jtag_shift_data(0xFF, 8, false, i == SPIFLASH_ID_LENGTH - 1));
+
+	return SPIFLASH_OK;
+}
+
+/**
+ * spiflash_crc
+ *
+ * Reads part of the flash, and computes its CRC.
+ *
+ * address:	The address to start reading at.
+ * length:	The number of bytes to read.
+ * crc:		Receives the CRC-32 of the data.
+ *
+ * Returns: A SPIFLASH_ result.
+ */
+uint8_t spiflash_crc(uint32_t address, uint32_t length, uint32_t* crc)
+{
+	uint8_t command[4];
+
+	if(!spiflash_select())
+		return SPIFLASH_NO_BRIDGE;
+
+	spiflash_check.crc = CRC32_INITIAL;
+	spiflash_check.blank = 0xFF;
+
+	spiflash_address_command(command, SPIFLASH_READ_DATA, address);
+	spiflash_read(command, sizeof(command), spiflash_check_byte, length);
+
+	*crc = ~spiflash_check.crc;
+	return SPIFLASH_OK;
+}
+
+/**
+ * spiflash_erase
+ *
+ * Erases a sector, unless it's already blank.
+ *
+ * command:	The erase command for the sector's size; for instance,
+ * 			SPIFLASH_ERASE_64K.
+ * address:	The address of the sector.
+ * length:	The length of the sector, in bytes.
+ * erased:	Receives true iff the sector needed erasing.
+ *
+ * Returns: A SPIFLASH_ result.
+ */
+uint8_t spiflash_erase(uint8_t command, uint32_t address, uint32_t length, bool* erased)
+{
+	uint8_t erase[4];
+	uint32_t crc;
+	uint8_t result = spiflash_crc(address, length, &crc);
+
+	*erased = false;
+
+	if(result != SPIFLASH_OK || spiflash_check.blank == 0xFF)
+		return result;
+
+	spiflash_write_enable();
+
+	spiflash_address_command(erase, command, address);
+	spiflash_send(erase, sizeof(erase), 8 * sizeof(erase), true);
+
+	*erased = true;
+	return spiflash_wait(SPIFLASH_ERASE_TIMEOUT) ? SPIFLASH_OK : SPIFLASH_TIMEOUT;
+}
+
+/**
+ * spiflash_program
+ *
+ * Programs erased flash, a page at a time; the data is fetched from the source
+ * as each page is sent.
+ *
+ * address:	The address to start programming at; need not start a page.
+ * source:	Provides the data, in order.
+ * length:	The number of bytes to program.
+ *
+ * Returns: A SPIFLASH_ result. After a timeout, the rest of the data is left
+ * 			in the source.
+ */
+uint8_t spiflash_program(uint32_t address, jtag_byte_source source, uint32_t length)
+{
+	uint8_t command[4];
+
+	if(!spiflash_select())
+		return SPIFLASH_NO_BRIDGE;
+
+	while(length)
+	{
+		//a page program wraps around within its page, so never crosses the end
+		uint16_t count = SPIFLASH_PAGE_SIZE - (address % SPIFLASH_PAGE_SIZE);
+
+		if(count > length)
+			count = length;
+
+		spiflash_write_enable();
+
+		spiflash_address_command(command, SPIFLASH_PAGE_PROGRAM, address);
+		spiflash_send(command, sizeof(command), 8 * (sizeof(command) + count), false);
+		jtag_shift_stream_msb(source, count, false, true);
+
+		if(!spiflash_wait(SPIFLASH_PROGRAM_TIMEOUT))
+			return SPIFLASH_TIMEOUT;
+
+		address += count;
+		length -= count;
+	}
+
+	return SPIFLASH_OK;
+}
+
+#endif
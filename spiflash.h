@@ -0,0 +1,74 @@
+#pragma once
+
+/**
+ * SPI Flash Programming
+ *
+ * Programs the SPI flash from which some boards' FPGAs configure themselves,
+ * through a small JTAG-to-SPI bridge design in the FPGA. The bridge is loaded
+ * first, like any other design (uploaded, or from the SD card or the flash
+ * image); once the flash is programmed, the FPGA can be reconfigured from it.
+ *
+ * The bridge is reached through the USER1 register. Each DR scan is a single
+ * SPI transaction: the bridge ignores TDI until it sees a one (the start bit),
+ * then takes the next 32 bits, MSB first, as the transaction's length in bits.
+ * For exactly that many TCKs it holds CS_B low and passes TCK to the flash's
+ * clock, with TDI as MOSI (MSB first); CS_B is raised once they've been clocked,
+ * or when the scan leaves Shift-DR, if that's sooner. TDO carries MISO, as
+ * sampled on each SPI clock, one TCK later. Only whole transactions are timed
+ * by the flash, so the extra bits of each scan (the chain's data header, and
+ * the bit which leaves Shift-DR) are never seen by it.
+ *
+ * Each page program is a transaction of its own, followed by polling the
+ * flash's status until the page is written; both happen on the device, so the
+ * host sends a run of pages as a single command. To save rewriting a sector
+ * which is already right, the host compares the CRC-32 (see crc32.h) of the
+ * sector, computed by the device, with that of its data; sectors which are
+ * already blank aren't erased again.
+ *
+ * Only built into SPI_FLASH builds (see unilab.h).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "jtag/core.h"
+
+//TCKs from a bit being clocked to its MISO reaching TDO: one in the bridge, and
+//one in the PROM's BYPASS register.
+#define SPIFLASH_LATENCY	2
+
+//Most bits in a transaction; as used for status polls, which end early.
+#define SPIFLASH_MAX_BITS	0xFFFFFFFF
+
+//Flash commands, common to the SPI flashes used for configuration.
+#define SPIFLASH_WRITE_ENABLE	0x06
+#define SPIFLASH_READ_STATUS	0x05
+#define SPIFLASH_READ_DATA	0x03
+#define SPIFLASH_PAGE_PROGRAM	0x02
+#define SPIFLASH_READ_ID	0x9F	/* JEDEC ID */
+#define SPIFLASH_ERASE_4K	0x20	/* subsector erase, where supported */
+#define SPIFLASH_ERASE_64K	0xD8	/* sector erase */
+
+//Status register bits.
+#define SPIFLASH_STATUS_WIP	0x01	/* a write or erase is in progress */
+
+#define SPIFLASH_PAGE_SIZE	256
+#define SPIFLASH_ID_LENGTH	3
+
+//Timeouts, in CPU cycles (see stats_now).
+#define SPIFLASH_PROGRAM_TIMEOUT	(F_CPU / 50)	/* for a page to be written */
+#define SPIFLASH_ERASE_TIMEOUT		(F_CPU * 4)	/* for a sector to be erased */
+
+//Results of flash operations.
+#define SPIFLASH_OK		0
+#define SPIFLASH_NO_BRIDGE	1	/* the FPGA isn't configured, so can't hold the bridge */
+#define SPIFLASH_TIMEOUT	2	/* the flash stayed busy */
+
+#ifdef SPI_FLASH
+
+uint8_t spiflash_read_id(uint8_t* id);
+uint8_t spiflash_crc(uint32_t address, uint32_t length, uint32_t* crc);
+uint8_t spiflash_erase(uint8_t command, uint32_t address, uint32_t length, bool* erased);
+uint8_t spiflash_program(uint32_t address, jtag_byte_source source, uint32_t length);
+
+#endif
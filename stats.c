@@ -0,0 +1,119 @@
+/**
+ * Performance Counters
+ *
+ * Timer3 free-runs at the system clock rate; its overflows are counted in an
+ * interrupt (once per 65536 cycles), which extends it to a 32-bit time.
+ */
+
+#include "stats.h"
+
+#include <string.h>
+#include <avr/interrupt.h>
+
+//Timer3 overflows, the upper half of the 32-bit time.
+static volatile uint16_t stats_overflows = 0;
+
+#ifdef PERF_STATS
+
+//The counters.
+stats_report stats;
+
+//The time at which the counters were last reset.
+static uint32_t stats_reset_time;
+
+#endif
+
+ISR(TIMER3_OVF_vect)
+{
+	++stats_overflows;
+}
+
+/**
+ * stats_initialize
+ *
+ * Starts the performance timer, and resets the counters.
+ */
+void stats_initialize(void)
+{
+	//normal mode, clk/1
+	TCCR3A = 0;
+	TCCR3B = (1 << CS30);
+	TIMSK3 = (1 << TOIE3);
+
+#ifdef PERF_STATS
+	stats_reset();
+#endif
+}
+
+/**
+ * stats_stop
+ *
+ * Stops the performance timer, and its overflow interrupt; as before leaving
+ * for the application, whose vectors would otherwise take the interrupt.
+ */
+void stats_stop(void)
+{
+	TIMSK3 = 0;
+	TCCR3B = 0;
+}
+
+/**
+ * stats_now
+ *
+ * Returns: The current time, in cycles.
+ */
+uint32_t stats_now(void)
+{
+	uint8_t sreg = SREG;
+	uint16_t high, low;
+
+	cli();
+
+	low = TCNT3;
+	high = stats_overflows;
+
+	//account for an overflow which hasn't been serviced yet
+	if((TIFR3 & (1 << TOV3)) && low < 0x8000)
+		++high;
+
+	SREG = sreg;
+
+	return ((uint32_t)high << 16) | low;
+}
+
+#ifdef PERF_STATS
+
+/**
+ * stats_add
+ *
+ * Ends a phase started at the given time (as returned by stats_now).
+ */
+void stats_add(uint8_t phase, uint32_t start)
+{
+	stats.phase[phase].cycles += stats_now() - start;
+	++stats.phase[phase].count;
+}
+
+/**
+ * stats_read
+ *
+ * Copies the counters, including the time elapsed since they were reset.
+ */
+void stats_read(stats_report* report)
+{
+	stats.elapsed = stats_now() - stats_reset_time;
+	memcpy(report, &stats, sizeof(stats_report));
+}
+
+/**
+ * stats_reset
+ *
+ * Zeroes the counters.
+ */
+void stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats_report));
+	stats_reset_time = stats_now();
+}
+
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+
+/**
+ * Performance Counters
+ *
+ * Accumulates the time spent in each phase of an upload, measured in CPU
+ * cycles by Timer3, which free-runs at the system clock rate.
+ *
+ * Short phases (a single byte shift) are timed with the 16-bit timer alone,
+ * which costs only a few cycles; long phases, which may span timer overflows,
+ * are timed with the 32-bit time from stats_now. Phases may nest (USB can be
+ * serviced during a long wait), in which case the time is counted in both.
+ *
+ * The counters are only kept in PERF_STATS builds (see unilab.h); otherwise,
+ * the timer still runs, as it times the SD card's and SPI flash's timeouts,
+ * but phases aren't counted.
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "unilab.h"
+
+//Phases.
+#define STATS_USB_WAIT		0x00	/* waiting for the host to send data */
+#define STATS_JTAG_SHIFT	0x01	/* shifting data over JTAG */
+#define STATS_SPM_WAIT		0x02	/* waiting for flash erase/write */
+#define STATS_RUN_TEST		0x03	/* clocking the FPGA in Run-Test/Idle */
+#define STATS_PHASES		4
+
+//Totals for a single phase. Cycle totals wrap after 2^32 cycles (about four
+//and a half minutes at 16MHz), so they should be reset before each measurement.
+typedef struct
+{
+	uint32_t cycles;
+	uint32_t count;
+} stats_phase;
+
+//All counters, as read by stats_read.
+typedef struct
+{
+	uint32_t elapsed;	/* cycles since the counters were reset */
+	uint32_t bytes;		/* command bytes received from the host */
+	stats_phase phase[STATS_PHASES];
+} stats_report;
+
+void stats_initialize(void);
+void stats_stop(void);
+uint32_t stats_now(void);
+
+#ifdef PERF_STATS
+
+extern stats_report stats;
+
+void stats_add(uint8_t phase, uint32_t start);
+void stats_read(stats_report* report);
+void stats_reset(void);
+
+/**
+ * stats_mark
+ *
+ * Returns: The start time of a short phase; see stats_add_short.
+ */
+static inline uint16_t stats_mark(void)
+{
+	return TCNT3;
+}
+
+/**
+ * stats_add_short
+ *
+ * Ends a short phase (less than 65536 cycles) started at stats_mark.
+ */
+static inline void stats_add_short(uint8_t phase, uint16_t start)
+{
+	stats.phase[phase].cycles += (uint16_t)(TCNT3 - start);
+	++stats.phase[phase].count;
+}
+
+/**
+ * stats_add_bytes
+ *
+ * Counts bytes processed.
+ */
+static inline void stats_add_bytes(uint16_t bytes)
+{
+	stats.bytes += bytes;
+}
+
+#else
+
+//Without the counters, phases cost nothing.
+static inline void stats_add(uint8_t phase, uint32_t start)
+{
+}
+
+static inline uint16_t stats_mark(void)
+{
+	return 0;
+}
+
+static inline void stats_add_short(uint8_t phase, uint16_t start)
+{
+}
+
+static inline void stats_add_bytes(uint16_t bytes)
+{
+}
+
+#endif
@@ -43,6 +43,19 @@ extern "C"
     #define DEVICE_UNILAB_BREADBOARD 0x03
     #define DEVICE_UNILAB_MARK1      0x04
 
+    //revision code of the target device
+    #if defined(UNILAB_BASYS_250K)
+        #define DEVICE_MODEL DEVICE_BASYS_250K
+    #elif defined(UNILAB_BASYS_100K)
+        #define DEVICE_MODEL DEVICE_BASYS_100K
+    #elif defined(UNILAB_BREADBOARD)
+        #define DEVICE_MODEL DEVICE_UNILAB_BREADBOARD
+    #elif defined(UNILAB_MARK1)
+        #define DEVICE_MODEL DEVICE_UNILAB_MARK1
+    #else
+        #error You need to choose a device type!
+    #endif
+
     /**
      * Flashable region definitions
      */
@@ -53,6 +66,50 @@ extern "C"
     #endif
 
 
+    /**
+     * Optional features. The whole firmware is linked into the boot section
+     * (4KB on the 32U4; see BOOT_START in the makefile), which has room for
+     * little beyond the USB stack and JTAG configuration. Uncomment (or define
+     * in the makefile) only the features a board needs, and check the size of
+     * the build with avr-size. CMD_WHOAMI reports the features built in.
+     */
+
+    //CMD_SET_CLOCK_OUT, to reprogram the FPGA clock (see clock.h). Without it,
+    //the clock stays at its default: half the system clock.
+    //#define CLOCK_OUT
+
+    //CMD_STATS performance counters (see stats.h).
+    //#define PERF_STATS
+
+    //CMD_BENCH self-benchmark (see bench.h).
+    //#define SELF_BENCH
+
+    //JTAG virtual console for soft cores (see console.h).
+    //#define JTAG_CONSOLE
+
+    //Boundary-scan SAMPLE capture and EXTEST interconnect tests (see
+    //jtag/boundary.h). Costs about 900 bytes of RAM.
+    //#define BOUNDARY_SCAN
+
+    //Table of FPGAs, keyed by IDCODE (see jtag/devices.h). Without it, every
+    //FPGA is configured as a Spartan-3E, and polled for readiness from the start.
+    //#define FPGA_DEVICE_TABLE
+
+    //Configuration files as written by bitgen (CMD_FPGA_CONFIG_FILE), and checks
+    //of the configuration packets as bitstreams pass (see jtag/bitstream.h).
+    //Needed by SD_CARD and FLASH_IMAGE.
+    //#define BITSTREAM_FILES
+
+    //Compressed bitstream image in spare application flash (see image.h).
+    //#define FLASH_IMAGE
+
+    //Configuration readback: CMD_FPGA_VERIFY and CMD_FPGA_SNAPSHOT (see readback.h).
+    //#define FPGA_READBACK
+
+    //SPI flash programming through a JTAG-SPI bridge (see spiflash.h).
+    //#define SPI_FLASH
+
+
     #if defined(UNILAB_BREADBOARD)
 
         //Manual Hardware Bootloader Select
@@ -123,6 +180,11 @@ extern "C"
         //i.e. the times represented will be in ms
         //#define JTAG_SLOW_CLOCK
 
+        //Define JTAG_TRACE to record the most recent JTAG operations, which
+        //can be read back with CMD_JTAG_TRACE. Costs 4 bytes of RAM per entry.
+        //#define JTAG_TRACE
+        //#define JTAG_TRACE_SIZE 32
+
     #elif defined(UNILAB_MARK1)
 
         //Manual Hardware Bootloader Select
@@ -161,6 +223,27 @@ extern "C"
         #define JTAG_TDO_DDR    DDRF
         #define JTAG_TDO_PIN    1
 
+        //Multi-lane JTAG: several targets share TCK and TMS, each with its own
+        //TDI and TDO. The lanes' TDI pins must be consecutive pins of a single
+        //port, starting with lane zero at JTAG_LANE_TDI_PIN; as must their TDO
+        //pins. When defined, these replace the TDI and TDO pins above.
+        //#define JTAG_LANES          4
+        //#define JTAG_LANE_TDI_PORT  PORTB
+        //#define JTAG_LANE_TDI_DDR   DDRB
+        //#define JTAG_LANE_TDI_PIN   0
+        //#define JTAG_LANE_TDO_PORT  PINB
+        //#define JTAG_LANE_TDO_DDR   DDRB
+        //#define JTAG_LANE_TDO_PIN   4
+
+        //SD card, on the hardware SPI port (SCK PB1, MOSI PB2, MISO PB3).
+        //Define SD_CARD to read bitstreams from the card, and configure the
+        //FPGA from its boot file at power-up; see sd.h. Can't be used with
+        //JTAG lanes on port B.
+        //#define SD_CARD
+        #define SD_CS_PORT  PORTB
+        #define SD_CS_DDR   DDRB
+        #define SD_CS_PIN   0
+
         //JTAG Timing
 
         //Define NO_DELAY to prevent the program from inducing delays.
@@ -181,10 +264,20 @@ extern "C"
         //i.e. the times represented will be in ms
         //#define JTAG_SLOW_CLOCK
 
+        //Define JTAG_TRACE to record the most recent JTAG operations, which
+        //can be read back with CMD_JTAG_TRACE. Costs 4 bytes of RAM per entry.
+        //#define JTAG_TRACE
+        //#define JTAG_TRACE_SIZE 32
+
 
 
     #endif
 
+    //Configuration from storage sends configuration files.
+    #if (defined(SD_CARD) || defined(FLASH_IMAGE)) && !defined(BITSTREAM_FILES)
+        #error SD_CARD and FLASH_IMAGE need BITSTREAM_FILES.
+    #endif
+
 
 #ifdef	__cplusplus
 }